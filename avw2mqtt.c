@@ -2,12 +2,20 @@
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <cjson/cJSON.h>
@@ -15,6 +23,14 @@
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <mosquitto.h>
+#include <mqtt_protocol.h>
+
+#ifdef WITH_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+#include "avw2mqtt_shm.h"
 
 #define MAX_AIRPORTS 64
 #define MAX_ICAO 8
@@ -28,6 +44,96 @@
 #define METAR_CAP_MINUTES 35
 #define TAF_CAP_MINUTES 65
 #define SLACK_SECONDS (5 * 60)
+#define BURST_SECONDS 15               // critical stations: poll interval while waiting for a predicted report
+#define BURST_WINDOW_SECONDS (10 * 60) // ... kept up for this long past the predicted issuance
+#define OFFCYCLE_TOLERANCE_SECONDS 120 // unmarked reports further than this off the learned period count as off-cycle
+#define OFFCYCLE_LIMIT 3               // ... until this many in a row, then the routine schedule is taken to have moved
+
+#define OBSERVE_ROUTINE 1
+#define OBSERVE_SPECIAL 2
+
+#define BACKOFF_BASE_SECONDS 60
+#define BACKOFF_MAX_SECONDS (30 * 60)
+#define CIRCUIT_FAILURES 6
+#define CIRCUIT_OPEN_SECONDS (60 * 60)
+#define STARTUP_SPREAD_SECONDS 30
+#define RECOVER_SECONDS 3
+
+#define MAX_TOPIC_ALIASES (MAX_AIRPORTS * 2)
+
+#define EARTH_RADIUS_KM 6371.0
+#define MAX_NEAREST 16
+
+#define UPSTREAM_DEFAULT "https://aviationweather.gov/api/data"
+#define UPSTREAM_TIMEOUT_SECONDS 15
+#define MAX_ENDPOINTS 4
+#define MAX_BROKERS 4
+#define BROKER_QUEUE 256
+#define BROKER_RECONNECT_MAX_SECONDS 60
+#define BROKER_INFLIGHT 8
+#define BROKER_DRAIN_SECONDS 5
+#define LATENCY_SAMPLES 64
+#define ENDPOINT_FAILURES 3
+#define ENDPOINT_DOWN_SECONDS 120
+#define HEDGE_SAMPLES_MIN 10
+#define HEDGE_DEFAULT_MS 2000
+#define HEDGE_MIN_MS 200
+
+#define ONDEMAND_TOPIC "_fetch"
+#define ONDEMAND_ENTRIES 128
+#define ONDEMAND_TTL_SECONDS 60
+#define ONDEMAND_WORKERS 2
+#define ONDEMAND_WORKERS_MAX 8
+
+#define CLUSTER_TOPIC "_cluster"
+#define MAX_CLUSTER_NODES 32
+#define CLUSTER_VNODES 64
+#define CLUSTER_HEARTBEAT_SECONDS 30
+#define CLUSTER_TIMEOUT_SECONDS 90
+#define CLUSTER_SETTLE_SECONDS 3
+
+#define MAX_TAF_GROUPS 32
+
+#define DELTA_KEYFRAME 12
+
+#define SNAPSHOT_DEBOUNCE_SECONDS 5
+
+#define STATIONINFO_MAGIC "# avw2mqtt stationinfo 1"
+#define STATIONINFO_TTL_DAYS 30
+#define STATIONINFO_BATCH 24
+#define STATIONINFO_CHECK_SECONDS (60 * 60)
+
+#define COMPRESS_LEVEL 12
+#define COMPRESS_DICT_SIZE (16 * 1024)
+#define COMPRESS_TRAIN_MIN 64
+
+#define SIM_EPOCH 1767225600 // 2026-01-01T00:00:00Z
+#define SIM_STATIONS 50
+#define SIM_DAYS 14
+#define SIM_STEP_SECONDS 5 // main loop poll interval
+#define SIM_TRACES 1024
+
+#define TRACE_SPANS 4096
+
+#define MAX_TEMPLATES 8
+#define MAX_TEMPLATE_NAME 32
+#define MAX_TEMPLATE_OPS 96
+#define MAX_TEMPLATE_POOL 512
+#define MAX_TEMPLATE_DEPTH 4
+#define MAX_TEMPLATE_TEXT 2048
+
+#define HISTORY_MAX 96
+#define INTERN_BUCKETS 1024
+
+#define ARCHIVE_MAGIC_SEGMENT "AVWA"
+#define ARCHIVE_MAGIC_BLOCK "AVWB"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_SEGMENT_HEADER 8
+#define ARCHIVE_BLOCK_HEADER 24
+#define ARCHIVE_BATCH_MAX 256
+#define ARCHIVE_DICT_MAX 4096
+#define ARCHIVE_FLUSH_RECORDS 32
+#define ARCHIVE_FLUSH_SECONDS (5 * 60)
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
@@ -43,10 +149,118 @@ typedef struct {
     time_t samples[LEARN_SAMPLES];
     int sample_count;
     int learned_period;
-    time_t last_issued;
+    time_t last_issued;  // latest routine report, the learned period is anchored on it
+    time_t last_special; // latest SPECI or off-cycle report
+    int offcycle;        // unmarked off-cycle reports in a row
     time_t next_fetch;
+    int failures;
+    time_t retry_at;
+    time_t last_archived;
+    int seeded; // last_issued taken over (retained message, cluster handover), local state not yet filled from a fetch
 } schedule_t;
 
+typedef enum { REPORT_METAR = 0, REPORT_TAF = 1 } report_type_t;
+
+typedef enum { PRIORITY_NORMAL = 0, PRIORITY_CRITICAL = 1, PRIORITY_LOW = 2 } priority_t;
+
+typedef struct {
+    const char *name;
+    int slack;      // seconds past the predicted issuance to fetch at (critical: to keep polling for)
+    int scale;      // percent applied to the default interval and the caps
+    double reserve; // share of the rate limit burst left to higher classes
+} priority_class_t;
+
+typedef struct interned {
+    struct interned *next;
+    uint32_t hash;
+    int refs;
+    char str[];
+} interned_t;
+
+typedef enum { TEMPLATE_OP_TEXT, TEMPLATE_OP_FIELD, TEMPLATE_OP_OPEN, TEMPLATE_OP_CLOSE } template_opcode_t;
+
+typedef struct {
+    uint8_t op, field;
+    uint16_t offset, length; // into the literal pool, for TEMPLATE_OP_TEXT
+} template_op_t;
+
+typedef struct {
+    template_op_t ops[MAX_TEMPLATE_OPS];
+    int count;
+} template_program_t;
+
+typedef struct {
+    char name[MAX_TEMPLATE_NAME];
+    char separator[16];
+    template_program_t metar, taf; // taf is run once per forecast period
+    char pool[MAX_TEMPLATE_POOL];
+    int pool_used;
+} template_t;
+
+typedef enum { TAF_GROUP_INITIAL, TAF_GROUP_FM, TAF_GROUP_BECMG, TAF_GROUP_TEMPO, TAF_GROUP_PROB } taf_group_type_t;
+
+typedef struct {
+    taf_group_type_t type;
+    time_t from, to;
+    int probability;
+    xmlNode *node;
+} taf_group_t;
+
+// the forecast element currently supplying each kind of condition
+typedef struct {
+    xmlNode *wind, *vis, *wx, *sky;
+} taf_conditions_t;
+
+typedef struct {
+    time_t observed, available; // issued, and when upstream starts serving it
+    int special;                // marked SPECI
+} sim_report_t;
+
+typedef struct {
+    char icao[MAX_ICAO];
+    report_type_t type;
+    priority_t priority;
+    sim_report_t *reports;
+    int count, capacity;
+    time_t outages[SIM_DAYS * 2][2];
+    int outage_count;
+} sim_trace_t;
+
+typedef struct {
+    unsigned long requests, reports, missed;
+    int *latencies;
+    size_t latency_count, latency_capacity;
+} sim_result_t;
+
+typedef struct {
+    const char *name, *description;
+    report_type_t type;
+    priority_t priority;
+    void (*generate)(sim_trace_t *trace, time_t start, time_t end);
+} sim_scenario_t;
+
+typedef struct {
+    station_t station;
+    time_t fetched;
+    int found; // 0: upstream does not know the station, cached so it is not asked for again before the TTL
+} stationinfo_t;
+
+typedef struct {
+    cJSON *base; // report as of the last keyframe, deltas are taken against it
+    int seq, keyframe;
+} delta_t;
+
+typedef struct {
+    time_t time;
+    interned_t *raw, *text;
+    report_type_t type;
+} history_record_t;
+
+typedef struct {
+    history_record_t records[HISTORY_MAX];
+    int head, count;
+} history_t;
+
 typedef struct {
     char icao[MAX_ICAO];
     char name[MAX_NAME];
@@ -55,10 +269,39 @@ typedef struct {
     cJSON *json;
     //
     int fetch_metar, fetch_taf, interval;
+    priority_t priority;
+    unsigned templates; // bitmask into cfg.templates
+    int owned;          // fetched by this node (always, unless clustered)
     time_t last_fetch;
     schedule_t sched_metar, sched_taf;
+    history_t history;
+    cJSON *taf_timeline;
+    time_t taf_changes; // when the effective TAF period next changes, 0 if not pending
+    delta_t delta[2];   // per report_type_t
+    cJSON *latest[2];   // compact latest report per report_type_t, for the snapshot
 } airport_t;
 
+typedef struct {
+    char base[MAX_URL];
+    int latencies[LATENCY_SAMPLES]; // successful response times (ms), ring
+    int latency_count, latency_next;
+    int failures;
+    time_t down_until;
+    unsigned long requests, errors;
+} endpoint_t;
+
+// an additional broker the reports fan out to, besides the one in "mqtt"
+typedef struct {
+    char broker[256];
+    char client_id[64];
+    char topic_prefix[128];
+    char username[64];
+    char password[64];
+    int protocol_version;
+    int compress;
+    int queue;
+} broker_config_t;
+
 typedef struct {
     char broker[256];
     char client_id[64];
@@ -66,7 +309,37 @@ typedef struct {
     char username[64];
     char password[64];
     char stations_file[256];
+    int protocol_version;
+    int compress;
+    int recover_seconds;
     int default_metar, default_taf, default_interval;
+    priority_t default_priority;
+    unsigned default_templates;
+    template_t templates[MAX_TEMPLATES];
+    int template_count;
+    double rate_per_minute, rate_burst;
+    int startup_spread;
+    int history_depth;
+    cJSON *regions;
+    char archive_directory[256];
+    int archive_flush_records, archive_flush_seconds;
+    int delta_keyframe;
+    int snapshot_enabled, snapshot_debounce, snapshot_compress;
+    int stationinfo_enabled;
+    char stationinfo_cache[256];
+    int stationinfo_ttl;
+    char shm_name[64];
+    broker_config_t brokers[MAX_BROKERS];
+    int broker_count;
+    endpoint_t endpoints[MAX_ENDPOINTS];
+    int endpoint_count;
+    int upstream_timeout, upstream_hedge;
+    int ondemand_ttl, ondemand_workers;
+    int cluster_enabled;
+    char cluster_node[64];
+    int cluster_vnodes, cluster_heartbeat, cluster_timeout;
+    char compress_dictionary[256];
+    int compress_level, compress_topic;
     airport_t airports[MAX_AIRPORTS];
     int airport_count;
 } config_t;
@@ -76,6 +349,116 @@ typedef struct {
     size_t size;
 } buffer_t;
 
+typedef struct {
+    _Atomic uint64_t seq; // span number + 1 once complete
+    const char *name;
+    char icao[MAX_ICAO];
+    int64_t start_us, duration_us;
+    uint32_t tid;
+} trace_span_t;
+
+typedef struct {
+    double xyz[3];
+    int station;
+} station_node_t;
+
+typedef struct {
+    time_t observed, issued, expires;
+} publish_meta_t;
+
+typedef struct broker_message {
+    struct broker_message *next;
+    char topic[MAX_TOPIC];
+    void *payload;
+    size_t length;
+    publish_meta_t meta;
+    unsigned dict_id;
+    int retain;
+} broker_message_t;
+
+typedef struct {
+    broker_config_t config;
+    struct mosquitto *mosq;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    broker_message_t *head, *tail;
+    int queued, inflight;
+    int connected, stop;
+    unsigned long published, coalesced, dropped;
+} broker_t;
+
+typedef struct {
+    char icaos[ARCHIVE_DICT_MAX][MAX_ICAO];
+    int count;
+} archive_dict_t;
+
+typedef struct {
+    time_t time;
+    int icao;
+    report_type_t type;
+    char *raw;
+} archive_record_t;
+
+typedef struct {
+    int fd;
+    char day[16];
+    archive_dict_t dict;
+    int dict_written;
+    archive_record_t pending[ARCHIVE_BATCH_MAX];
+    int pending_count;
+    time_t pending_since;
+} archive_t;
+
+typedef struct {
+    char icao[MAX_ICAO];
+    char topic[MAX_TOPIC];
+    void *correlation;
+    uint16_t correlation_len;
+    cJSON *root;
+    int pending; // entries still to complete before responding
+} ondemand_request_t;
+
+typedef struct ondemand_waiter {
+    ondemand_request_t *request;
+    struct ondemand_waiter *next;
+} ondemand_waiter_t;
+
+typedef struct {
+    char icao[MAX_ICAO];
+    report_type_t type;
+    int in_flight, queued;
+    time_t fetched_at;
+    cJSON *result;
+    ondemand_waiter_t *waiters;
+} ondemand_entry_t;
+
+typedef struct {
+    char id[64];
+    time_t seen;
+} cluster_node_t;
+
+typedef struct {
+    uint64_t hash;
+    int node;
+} cluster_point_t;
+
+#ifdef WITH_ZSTD
+typedef struct {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+    unsigned dict_id;
+    unsigned long long bytes_in, bytes_out;
+} compress_t;
+#endif
+
+typedef struct {
+    double tokens, rate, burst;
+    struct timespec last;
+} ratelimit_t;
+
 typedef struct {
     int debug;
     int header;
@@ -83,29 +466,83 @@ typedef struct {
     int learn;
     int split;
     const char *config_path;
+    const char *archive_dump;
+    const char *trace;
+    const char *train;
+    const char *simulate;
 } options_t;
 
 static volatile int running = 1;
+static volatile int reload = 0;
+static volatile int recovering = 0;
+static volatile int trace_dump_requested = 0;
+static int recovered = 0;
 static struct mosquitto *mosq = NULL;
 
+static char topic_aliases[MAX_TOPIC_ALIASES][MAX_TOPIC];
+static int topic_alias_count = 0;
+static _Atomic int topic_alias_maximum = 0; // written by the network thread on connect
+static _Atomic int topic_alias_reset = 0;
+
 static config_t cfg;
-static options_t opts = {0, 0, 0, 1, 0, "avw2mqtt.conf"};
+static ratelimit_t ratelimit;
+
+static interned_t *intern_buckets[INTERN_BUCKETS];
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t upstream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ratelimit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static ondemand_entry_t ondemand_entries[ONDEMAND_ENTRIES];
+static pthread_mutex_t ondemand_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ondemand_cond = PTHREAD_COND_INITIALIZER;
+static int ondemand_stopping = 0; // under ondemand_mutex: workers are gone, requests are dropped
+static pthread_t ondemand_threads[ONDEMAND_WORKERS_MAX];
+static int ondemand_thread_count = 0;
+
+static cluster_node_t cluster_nodes[MAX_CLUSTER_NODES];
+static int cluster_node_count = 0;
+static int cluster_changed = 0, cluster_owned = 0;
+static time_t cluster_heartbeat_at = 0;
+static pthread_mutex_t cluster_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static station_t *stations = NULL;
+static station_node_t *station_nodes = NULL;
+static int station_count = 0, station_capacity = 0;
+static stationinfo_t *stationinfo = NULL;
+static int stationinfo_count = 0, stationinfo_capacity = 0;
+static time_t stationinfo_check_at = 0;
+static time_t snapshot_changed = 0; // first change not yet in a published snapshot
+
+static trace_span_t trace_spans[TRACE_SPANS];
+static _Atomic uint64_t trace_head = 0;
+static _Atomic uint32_t trace_threads = 0;
+static _Thread_local uint32_t trace_tid = 0;
+
+static archive_t archive = {.fd = -1};
+#ifdef WITH_ZSTD
+static compress_t compress;
+static pthread_mutex_t compress_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static broker_t brokers[MAX_BROKERS];
+static int broker_count = 0;
+static avw_shm_t *shm_feed = NULL;
+static options_t opts = {0, 0, 0, 1, 0, "avw2mqtt.conf", NULL, NULL, NULL, NULL};
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-static const char *timestamp_to_str(const time_t t) {
-    static char timestamp[32];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
-    return timestamp;
+// reentrant: fetches, fan-out brokers and on-demand workers format times on their own threads
+static const char *timestamp_to_str(char *out, size_t sz, time_t t) {
+    struct tm tm;
+    strftime(out, sz, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
+    return out;
 }
 
 static void debug(const char *fmt, ...) {
     if (!opts.debug)
         return;
-    const time_t now = time(NULL);
     char timestamp[32];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    timestamp_to_str(timestamp, sizeof(timestamp), time(NULL));
     va_list ap;
     va_start(ap, fmt);
     fprintf(stderr, "[%s] [debug] ", timestamp);
@@ -138,6 +575,87 @@ static char *read_file(const char *path, const char *type) {
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
+static int64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void trace_span(const char *name, const char *icao, int64_t start_us, int64_t duration_us) {
+    if (!opts.trace)
+        return;
+    if (!trace_tid)
+        trace_tid = atomic_fetch_add(&trace_threads, 1) + 1;
+    const uint64_t index = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+    trace_span_t *span = &trace_spans[index % TRACE_SPANS];
+    atomic_store_explicit(&span->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    span->name = name;
+    snprintf(span->icao, sizeof(span->icao), "%s", icao ? icao : "");
+    span->start_us = start_us;
+    span->duration_us = duration_us;
+    span->tid = trace_tid;
+    atomic_store_explicit(&span->seq, index + 1, memory_order_release);
+}
+
+static void trace_end(const char *name, const char *icao, int64_t start_us) {
+    if (opts.trace)
+        trace_span(name, icao, start_us, trace_now() - start_us);
+}
+
+static void trace_curl(CURL *curl, const char *icao, int64_t start_us) {
+    if (!opts.trace)
+        return;
+    curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, first_byte = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    trace_span("fetch", icao, start_us, total);
+    trace_span("dns", icao, start_us, dns);
+    if (connect > dns)
+        trace_span("connect", icao, start_us + dns, connect - dns);
+    if (tls > connect)
+        trace_span("tls", icao, start_us + connect, tls - connect);
+    if (first_byte > pretransfer)
+        trace_span("server", icao, start_us + pretransfer, first_byte - pretransfer);
+    if (total > first_byte)
+        trace_span("transfer", icao, start_us + first_byte, total - first_byte);
+}
+
+static void trace_dump(void) {
+    FILE *f = fopen(opts.trace, "w");
+    if (!f) {
+        fprintf(stderr, "trace: cannot write %s: %s\n", opts.trace, strerror(errno));
+        return;
+    }
+    const uint64_t head = atomic_load_explicit(&trace_head, memory_order_acquire);
+    const uint64_t first = head > TRACE_SPANS ? head - TRACE_SPANS : 0;
+    int count = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (uint64_t i = first; i < head; i++) {
+        const trace_span_t *span = &trace_spans[i % TRACE_SPANS];
+        if (atomic_load_explicit(&span->seq, memory_order_acquire) != i + 1)
+            continue;
+        const trace_span_t copy = {.name = span->name, .start_us = span->start_us, .duration_us = span->duration_us, .tid = span->tid};
+        char icao[MAX_ICAO];
+        memcpy(icao, span->icao, sizeof(icao));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&span->seq, memory_order_relaxed) != i + 1)
+            continue;
+        fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"avw2mqtt\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%u,\"args\":{\"icao\":\"%s\"}}", count++ ? "," : "", copy.name,
+                (long long)copy.start_us, (long long)copy.duration_us, (int)getpid(), copy.tid, icao);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    printf("trace: wrote %d span(s) to %s\n", count, opts.trace);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
 static const char *parse_skip_ws(const char *p) {
     while (*p && isspace(*p))
         p++;
@@ -288,6 +806,218 @@ static int stations_load(const char *path, station_load_cb cb, void *userdata) {
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
+static void station_collect_cb(const station_t *st, void *userdata) {
+    (void)userdata;
+    if (station_count >= station_capacity) {
+        const int capacity = station_capacity ? station_capacity * 2 : 256;
+        station_t *tmp = realloc(stations, sizeof(station_t) * (size_t)capacity);
+        if (!tmp)
+            return;
+        stations = tmp;
+        station_capacity = capacity;
+    }
+    stations[station_count++] = *st;
+}
+
+static const station_t *station_find(const char *icao) {
+    for (int i = 0; i < station_count; i++)
+        if (strcmp(stations[i].icao, icao) == 0)
+            return &stations[i];
+    return NULL;
+}
+
+static void geo_xyz(double lat, double lon, double xyz[3]) {
+    const double phi = lat * M_PI / 180.0, lambda = lon * M_PI / 180.0;
+    xyz[0] = cos(phi) * cos(lambda);
+    xyz[1] = cos(phi) * sin(lambda);
+    xyz[2] = sin(phi);
+}
+
+static double geo_chord2(const double a[3], const double b[3]) {
+    const double dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+    return dx * dx + dy * dy + dz * dz;
+}
+
+static double geo_km_to_chord2(double km) {
+    const double angle = km / EARTH_RADIUS_KM;
+    if (angle >= M_PI)
+        return 4.0;
+    const double chord = 2.0 * sin(angle / 2.0);
+    return chord * chord;
+}
+
+static double geo_chord2_to_km(double chord2) {
+    return 2.0 * asin(sqrt(chord2) / 2.0) * EARTH_RADIUS_KM;
+}
+
+// k-d tree over unit-sphere coordinates, stored implicitly: the median of each range is its node, split on axis (depth % 3)
+
+static void stations_index_select(int lo, int hi, int k, int axis) {
+    while (hi - lo > 1) {
+        const double pivot = station_nodes[(lo + hi) / 2].xyz[axis];
+        int i = lo, j = hi - 1;
+        while (i <= j) {
+            while (station_nodes[i].xyz[axis] < pivot)
+                i++;
+            while (station_nodes[j].xyz[axis] > pivot)
+                j--;
+            if (i <= j) {
+                const station_node_t tmp = station_nodes[i];
+                station_nodes[i++] = station_nodes[j];
+                station_nodes[j--] = tmp;
+            }
+        }
+        if (k <= j)
+            hi = j + 1;
+        else if (k >= i)
+            lo = i;
+        else
+            return;
+    }
+}
+
+static void stations_index_build(int lo, int hi, int depth) {
+    if (hi - lo <= 1)
+        return;
+    const int mid = (lo + hi) / 2;
+    stations_index_select(lo, hi, mid, depth % 3);
+    stations_index_build(lo, mid, depth + 1);
+    stations_index_build(mid + 1, hi, depth + 1);
+}
+
+static int stations_index(void) {
+    free(station_nodes);
+    station_nodes = NULL;
+    if (station_count == 0)
+        return 0;
+    station_nodes = malloc(sizeof(station_node_t) * (size_t)station_count);
+    if (!station_nodes)
+        return -1;
+    for (int i = 0; i < station_count; i++) {
+        geo_xyz(stations[i].lat, stations[i].lon, station_nodes[i].xyz);
+        station_nodes[i].station = i;
+    }
+    stations_index_build(0, station_count, 0);
+    debug("stations: indexed %d item(s)", station_count);
+    return 0;
+}
+
+typedef void (*station_found_cb)(const station_t *st, double distance_km, void *userdata);
+
+static void stations_index_within(int lo, int hi, int depth, const double q[3], double limit2, station_found_cb cb, void *userdata) {
+    if (lo >= hi)
+        return;
+    const int mid = (lo + hi) / 2, axis = depth % 3;
+    const station_node_t *node = &station_nodes[mid];
+    const double d2 = geo_chord2(q, node->xyz);
+    if (d2 <= limit2)
+        cb(&stations[node->station], geo_chord2_to_km(d2), userdata);
+    const double diff = q[axis] - node->xyz[axis];
+    if (diff <= 0 || diff * diff <= limit2)
+        stations_index_within(lo, mid, depth + 1, q, limit2, cb, userdata);
+    if (diff >= 0 || diff * diff <= limit2)
+        stations_index_within(mid + 1, hi, depth + 1, q, limit2, cb, userdata);
+}
+
+static void stations_within(double lat, double lon, double radius_km, station_found_cb cb, void *userdata) {
+    if (!station_nodes)
+        return;
+    double q[3];
+    geo_xyz(lat, lon, q);
+    stations_index_within(0, station_count, 0, q, geo_km_to_chord2(radius_km), cb, userdata);
+}
+
+static void stations_index_nearest(int lo, int hi, int depth, const double q[3], int k, int *best, double *best2, int *found) {
+    if (lo >= hi)
+        return;
+    const int mid = (lo + hi) / 2, axis = depth % 3;
+    const station_node_t *node = &station_nodes[mid];
+    const double d2 = geo_chord2(q, node->xyz);
+    if (*found < k || d2 < best2[*found - 1]) {
+        int i = *found < k ? (*found)++ : k - 1;
+        for (; i > 0 && best2[i - 1] > d2; i--) {
+            best[i] = best[i - 1];
+            best2[i] = best2[i - 1];
+        }
+        best[i] = node->station;
+        best2[i] = d2;
+    }
+    const double diff = q[axis] - node->xyz[axis];
+    const int near_lo = diff <= 0 ? lo : mid + 1, near_hi = diff <= 0 ? mid : hi;
+    const int far_lo = diff <= 0 ? mid + 1 : lo, far_hi = diff <= 0 ? hi : mid;
+    stations_index_nearest(near_lo, near_hi, depth + 1, q, k, best, best2, found);
+    if (*found < k || diff * diff < best2[*found - 1])
+        stations_index_nearest(far_lo, far_hi, depth + 1, q, k, best, best2, found);
+}
+
+static int stations_nearest(double lat, double lon, int k, int *best, double *best_km) {
+    if (!station_nodes || k <= 0)
+        return 0;
+    if (k > MAX_NEAREST)
+        k = MAX_NEAREST;
+    double q[3], best2[MAX_NEAREST];
+    geo_xyz(lat, lon, q);
+    int found = 0;
+    stations_index_nearest(0, station_count, 0, q, k, best, best2, &found);
+    for (int i = 0; i < found; i++)
+        best_km[i] = geo_chord2_to_km(best2[i]);
+    return found;
+}
+
+static void stations_free(void) {
+    free(stations);
+    free(station_nodes);
+    stations = NULL;
+    station_nodes = NULL;
+    station_count = station_capacity = 0;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+static const priority_class_t priority_classes[] = {
+    {"normal", SLACK_SECONDS, 100, 0.25},
+    {"critical", BURST_WINDOW_SECONDS, 100, 0.0},
+    {"low", 2 * SLACK_SECONDS, 200, 0.5},
+};
+
+static priority_t priority_parse(const char *name, priority_t fallback) {
+    for (size_t i = 0; i < sizeof(priority_classes) / sizeof(priority_classes[0]); i++)
+        if (name && !strcmp(name, priority_classes[i].name))
+            return (priority_t)i;
+    fprintf(stderr, "config: unknown priority '%s', using '%s'\n", name ? name : "", priority_classes[fallback].name);
+    return fallback;
+}
+
+static void ratelimit_init(ratelimit_t *rl, double per_minute, double burst) {
+    pthread_mutex_lock(&ratelimit_mutex);
+    rl->rate = per_minute / 60.0;
+    rl->burst = burst > 1 ? burst : 1;
+    rl->tokens = rl->burst;
+    clock_gettime(CLOCK_MONOTONIC, &rl->last);
+    pthread_mutex_unlock(&ratelimit_mutex);
+}
+
+// lower classes leave part of the burst unused, so that when the budget runs short critical stations still get their requests
+static int ratelimit_take(ratelimit_t *rl, priority_t priority) {
+    if (rl->rate <= 0)
+        return 1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&ratelimit_mutex);
+    rl->tokens += ((double)(now.tv_sec - rl->last.tv_sec) + (double)(now.tv_nsec - rl->last.tv_nsec) / 1e9) * rl->rate;
+    if (rl->tokens > rl->burst)
+        rl->tokens = rl->burst;
+    rl->last = now;
+    const int taken = rl->tokens >= 1 + priority_classes[priority].reserve * (rl->burst - 1);
+    if (taken)
+        rl->tokens -= 1;
+    pthread_mutex_unlock(&ratelimit_mutex);
+    if (!taken)
+        debug("ratelimit: %s request deferred", priority_classes[priority].name);
+    return taken;
+}
+
 static size_t curl_write_cb(const void *ptr, size_t size, size_t nmemb, void *userdata) {
     buffer_t *buf = (buffer_t *)userdata;
     const size_t total = size * nmemb;
@@ -301,26 +1031,194 @@ static size_t curl_write_cb(const void *ptr, size_t size, size_t nmemb, void *us
     return total;
 }
 
-static char *fetch_url(const char *url) {
+static int endpoint_compare_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+static int endpoint_p95(const endpoint_t *ep) {
+    if (ep->latency_count < HEDGE_SAMPLES_MIN)
+        return HEDGE_DEFAULT_MS;
+    int sorted[LATENCY_SAMPLES];
+    memcpy(sorted, ep->latencies, sizeof(int) * (size_t)ep->latency_count);
+    qsort(sorted, (size_t)ep->latency_count, sizeof(int), endpoint_compare_int);
+    return sorted[(ep->latency_count * 95 + 99) / 100 - 1];
+}
+
+static int endpoint_hedge_delay(const endpoint_t *ep) {
+    pthread_mutex_lock(&upstream_mutex);
+    const int delay = endpoint_p95(ep);
+    pthread_mutex_unlock(&upstream_mutex);
+    return delay < HEDGE_MIN_MS ? HEDGE_MIN_MS : delay > cfg.upstream_timeout * 1000 ? cfg.upstream_timeout * 1000 : delay;
+}
+
+// caller holds upstream_mutex
+static void endpoint_sample(endpoint_t *ep, int latency_ms) {
+    ep->latencies[ep->latency_next] = latency_ms;
+    ep->latency_next = (ep->latency_next + 1) % LATENCY_SAMPLES;
+    if (ep->latency_count < LATENCY_SAMPLES)
+        ep->latency_count++;
+}
+
+// a request cancelled after 'elapsed_ms' would have taken at least that long; keeping it as a (censored) sample stops the slow
+// tail from disappearing each time a hedge wins, which would pull the hedge delay down for good
+static void endpoint_censored(endpoint_t *ep, int elapsed_ms) {
+    pthread_mutex_lock(&upstream_mutex);
+    endpoint_sample(ep, elapsed_ms);
+    pthread_mutex_unlock(&upstream_mutex);
+}
+
+static void endpoint_record(endpoint_t *ep, int ok, int latency_ms) {
+    pthread_mutex_lock(&upstream_mutex);
+    ep->requests++;
+    if (ok) {
+        endpoint_sample(ep, latency_ms);
+        if (ep->failures >= ENDPOINT_FAILURES)
+            printf("upstream: %s recovered\n", ep->base);
+        ep->failures = 0;
+        ep->down_until = 0;
+    } else {
+        ep->errors++;
+        if (++ep->failures >= ENDPOINT_FAILURES) {
+            ep->down_until = time(NULL) + ENDPOINT_DOWN_SECONDS;
+            printf("upstream: %s down after %d failure(s), retry in %d seconds\n", ep->base, ep->failures, ENDPOINT_DOWN_SECONDS);
+        }
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+}
+
+// healthy endpoints in configured (preference) order, then those marked down as a last resort
+static int endpoints_order(int *order) {
+    const time_t now = time(NULL);
+    int count = 0;
+    pthread_mutex_lock(&upstream_mutex);
+    for (int pass = 0; pass < 2; pass++)
+        for (int i = 0; i < cfg.endpoint_count; i++)
+            if ((cfg.endpoints[i].down_until <= now) == (pass == 0))
+                order[count++] = i;
+    pthread_mutex_unlock(&upstream_mutex);
+    return count;
+}
+
+typedef struct {
+    CURL *curl;
+    buffer_t buf;
+    int endpoint;
+    int64_t start;
+} upstream_attempt_t;
+
+static int upstream_launch(CURLM *multi, upstream_attempt_t *attempt, int endpoint, const char *path) {
+    char url[MAX_URL];
+    snprintf(url, sizeof(url), "%s%s", cfg.endpoints[endpoint].base, path);
     debug("fetch: %s", url);
-    CURL *curl = curl_easy_init();
-    if (!curl)
+    attempt->curl = curl_easy_init();
+    if (!attempt->curl)
+        return -1;
+    attempt->buf = (buffer_t){NULL, 0};
+    attempt->endpoint = endpoint;
+    attempt->start = trace_now();
+    curl_easy_setopt(attempt->curl, CURLOPT_URL, url);
+    curl_easy_setopt(attempt->curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
+    curl_easy_setopt(attempt->curl, CURLOPT_WRITEDATA, &attempt->buf);
+    curl_easy_setopt(attempt->curl, CURLOPT_TIMEOUT, (long)cfg.upstream_timeout);
+    curl_easy_setopt(attempt->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(attempt->curl, CURLOPT_PRIVATE, (void *)attempt);
+    curl_multi_add_handle(multi, attempt->curl);
+    return 0;
+}
+
+static void upstream_release(CURLM *multi, upstream_attempt_t *attempt) {
+    curl_multi_remove_handle(multi, attempt->curl);
+    curl_easy_cleanup(attempt->curl);
+    attempt->curl = NULL;
+    free(attempt->buf.data);
+    attempt->buf.data = NULL;
+}
+
+// fetch path from the endpoints: the preferred endpoint first, a hedged request to the next once the preferred one runs past its
+// p95 latency, and immediate failover on errors; the first success wins and any request still running is cancelled
+// the caller has taken one request from the rate limit; failover and hedge requests each take another at 'priority'
+static char *fetch_upstream(const char *path, const char *icao, priority_t priority) {
+    int order[MAX_ENDPOINTS];
+    const int count = endpoints_order(order);
+    if (!count)
         return NULL;
-    buffer_t buf = {NULL, 0};
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 15L);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    const CURLcode res = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
-    if (res != CURLE_OK) {
-        debug("fetch: failed (%s)", curl_easy_strerror(res));
-        free(buf.data);
+    CURLM *multi = curl_multi_init();
+    if (!multi)
         return NULL;
+    upstream_attempt_t attempts[MAX_ENDPOINTS + 1];
+    int started = 0, active = 0, hedged = 0;
+    char *result = NULL;
+    const int64_t hedge_at = trace_now() + (int64_t)endpoint_hedge_delay(&cfg.endpoints[order[0]]) * 1000;
+    if (upstream_launch(multi, &attempts[started], order[started], path) == 0) {
+        started++;
+        active++;
+    }
+    while (active > 0 && !result) {
+        int still_running = 0;
+        curl_multi_perform(multi, &still_running);
+        CURLMsg *msg;
+        int queued;
+        while (!result && (msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            char *private = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private);
+            upstream_attempt_t *attempt = (upstream_attempt_t *)(void *)private;
+            endpoint_t *ep = &cfg.endpoints[attempt->endpoint];
+            long code = 0;
+            curl_easy_getinfo(attempt->curl, CURLINFO_RESPONSE_CODE, &code);
+            const int ok = msg->data.result == CURLE_OK && code < 400;
+            trace_curl(attempt->curl, icao, attempt->start);
+            endpoint_record(ep, ok, (int)((trace_now() - attempt->start) / 1000));
+            active--;
+            if (ok) {
+                debug("fetch: received %zu bytes from %s%s: >>>%s<<<", attempt->buf.size, ep->base, attempt != &attempts[0] ? " (hedge/failover)" : "",
+                      attempt->buf.data ? attempt->buf.data : "");
+                result = attempt->buf.data ? attempt->buf.data : strdup("");
+                attempt->buf.data = NULL;
+            } else {
+                if (msg->data.result != CURLE_OK)
+                    debug("fetch: failed from %s (%s)", ep->base, curl_easy_strerror(msg->data.result));
+                else
+                    debug("fetch: failed from %s (HTTP %ld)", ep->base, code);
+                if (started < count && ratelimit_take(&ratelimit, priority) && upstream_launch(multi, &attempts[started], order[started], path) == 0) {
+                    started++;
+                    active++;
+                }
+            }
+            upstream_release(multi, attempt);
+        }
+        if (result)
+            break;
+        const int64_t now = trace_now();
+        if (cfg.upstream_hedge && !hedged && active == 1 && now >= hedge_at) {
+            // a hedge to the endpoint that is already slow would only double its load
+            const int endpoint = started < count ? order[started] : -1;
+            hedged = 1;
+            if (endpoint < 0)
+                debug("fetch: not hedging, no other endpoint left to try");
+            else if (!ratelimit_take(&ratelimit, priority))
+                debug("fetch: not hedging, no request left in the budget");
+            else {
+                debug("fetch: hedging to %s after %lld ms", cfg.endpoints[endpoint].base, (long long)(now - attempts[0].start) / 1000);
+                if (upstream_launch(multi, &attempts[started], endpoint, path) == 0) {
+                    started++;
+                    active++;
+                }
+            }
+        }
+        const int wait_ms = cfg.upstream_hedge && !hedged && now < hedge_at ? (int)((hedge_at - now) / 1000) + 1 : 1000;
+        if (active > 0)
+            curl_multi_poll(multi, NULL, 0, wait_ms, NULL);
     }
-    debug("fetch: received %zu bytes: >>>%s<<<", buf.size, buf.data);
-    return buf.data;
+    for (int i = 0; i < started; i++)
+        if (attempts[i].curl) {
+            debug("fetch: cancelled request to %s", cfg.endpoints[attempts[i].endpoint].base);
+            endpoint_censored(&cfg.endpoints[attempts[i].endpoint], (int)((trace_now() - attempts[i].start) / 1000));
+            upstream_release(multi, &attempts[i]);
+        }
+    curl_multi_cleanup(multi);
+    return result;
 }
 
 static xmlNode *xml_find(xmlNode *node, const char *name) {
@@ -591,33 +1489,519 @@ static void format_end(char *out, size_t sz) {
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-static void schedule_add_sample(schedule_t *sched, const char *icao, time_t issued) {
-    if (issued == 0)
-        return;
-    if (sched->sample_count >= LEARN_SAMPLES) {
-        memmove(&sched->samples[0], &sched->samples[1], (LEARN_SAMPLES - 1) * sizeof(time_t));
-        sched->sample_count = LEARN_SAMPLES - 1;
-    }
-    debug("[%s] add sample [%d]: %ld (%s)", icao, sched->sample_count, issued, timestamp_to_str(issued)); // XXX
-    sched->samples[sched->sample_count++] = issued;
+typedef enum {
+    FIELD_ICAO,
+    FIELD_NAME,
+    FIELD_RAW,
+    FIELD_TIME,
+    FIELD_FROM,
+    FIELD_TO,
+    FIELD_CHANGE,
+    FIELD_PROBABILITY,
+    FIELD_WIND_DIR,
+    FIELD_WIND_KT,
+    FIELD_WIND_KMH,
+    FIELD_WIND_MS,
+    FIELD_WIND_MPH,
+    FIELD_GUST_KT,
+    FIELD_GUST_KMH,
+    FIELD_GUST_MS,
+    FIELD_GUST_MPH,
+    FIELD_VIS_M,
+    FIELD_VIS_KM,
+    FIELD_VIS_SM,
+    FIELD_WX,
+    FIELD_WEATHER,
+    FIELD_CLOUDS,
+    FIELD_SKY,
+    FIELD_CEILING_FT,
+    FIELD_CEILING_M,
+    FIELD_TEMP_C,
+    FIELD_TEMP_F,
+    FIELD_DEWPOINT_C,
+    FIELD_DEWPOINT_F,
+    FIELD_QNH_HPA,
+    FIELD_ALTIM_INHG,
+    FIELD_CATEGORY,
+    FIELD_COUNT
+} template_field_t;
+
+static const char *template_fields[FIELD_COUNT] = {
+    "icao",     "name",     "raw",     "time",    "from",       "to",        "change",    "probability", "wind_dir",   "wind_kt",    "wind_kmh",
+    "wind_ms",  "wind_mph", "gust_kt", "gust_kmh", "gust_ms",   "gust_mph",  "vis_m",     "vis_km",      "vis_sm",     "wx",         "weather",
+    "clouds",   "sky",      "ceiling_ft", "ceiling_m", "temp_c", "temp_f",   "dewpoint_c", "dewpoint_f", "qnh_hpa",    "altim_inhg", "category",
+};
+
+typedef struct {
+    const airport_t *ap;
+    xmlNode *report, *node; // the METAR or TAF element, and the METAR or TAF forecast period being rendered
+    uint64_t resolved, present;
+    uint16_t offsets[FIELD_COUNT];
+    char values[MAX_TEMPLATE_TEXT];
+    size_t used;
+} template_context_t;
+
+static int template_field_find(const char *name, size_t length) {
+    for (int i = 0; i < FIELD_COUNT; i++)
+        if (strlen(template_fields[i]) == length && strncmp(template_fields[i], name, length) == 0)
+            return i;
+    return -1;
 }
 
-static void schedule_add_missed(schedule_t *sched, const char *icao, const char *type) {
-    if (sched->sample_count > 2) {
-        debug("[%s] %s unexpected timing, reducing samples %d -> 2", icao, type, sched->sample_count);
-        sched->samples[0] = sched->samples[sched->sample_count - 2];
-        sched->samples[1] = sched->samples[sched->sample_count - 1];
-        sched->sample_count = 2;
-    }
-    sched->learned_period = 0;
+static int template_emit(template_program_t *program, template_opcode_t op, int field, uint16_t offset, uint16_t length) {
+    if (program->count >= MAX_TEMPLATE_OPS)
+        return -1;
+    program->ops[program->count++] = (template_op_t){(uint8_t)op, (uint8_t)field, offset, length};
+    return 0;
 }
 
-static void schedule_learn(schedule_t *sched, const char *icao, const char *type, int cap_minutes) {
-    if (sched->sample_count < 2)
-        return;
-    int deltas[LEARN_SAMPLES - 1];
-    int delta_count = 0;
-    for (int i = 1; i < sched->sample_count; i++) {
+// "literal {field} [optional {field}]": a [...] group is dropped when any field inside it is absent; '\' escapes the next character
+static int template_compile(template_t *t, template_program_t *program, const char *source) {
+    int depth = 0;
+    const char *p = source;
+    while (*p) {
+        if (*p == '{') {
+            const char *end = strchr(p + 1, '}');
+            if (!end) {
+                fprintf(stderr, "templates: '%s': unterminated '{'\n", t->name);
+                return -1;
+            }
+            const int field = template_field_find(p + 1, (size_t)(end - p - 1));
+            if (field < 0) {
+                fprintf(stderr, "templates: '%s': unknown field '%.*s'\n", t->name, (int)(end - p - 1), p + 1);
+                return -1;
+            }
+            if (template_emit(program, TEMPLATE_OP_FIELD, field, 0, 0) < 0)
+                goto too_long;
+            p = end + 1;
+        } else if (*p == '[' || *p == ']') {
+            depth += *p == '[' ? 1 : -1;
+            if (depth < 0 || depth > MAX_TEMPLATE_DEPTH) {
+                fprintf(stderr, "templates: '%s': unbalanced or too deeply nested '[]'\n", t->name);
+                return -1;
+            }
+            if (template_emit(program, *p == '[' ? TEMPLATE_OP_OPEN : TEMPLATE_OP_CLOSE, 0, 0, 0) < 0)
+                goto too_long;
+            p++;
+        } else {
+            const int offset = t->pool_used;
+            while (*p && *p != '{' && *p != '[' && *p != ']') {
+                if (*p == '\\' && p[1])
+                    p++;
+                if (t->pool_used >= MAX_TEMPLATE_POOL)
+                    goto too_long;
+                t->pool[t->pool_used++] = *p++;
+            }
+            // adjacent literals (split by an escape) are merged into one op
+            template_op_t *last = program->count > 0 ? &program->ops[program->count - 1] : NULL;
+            if (last && last->op == TEMPLATE_OP_TEXT && last->offset + last->length == offset)
+                last->length = (uint16_t)(last->length + t->pool_used - offset);
+            else if (template_emit(program, TEMPLATE_OP_TEXT, 0, (uint16_t)offset, (uint16_t)(t->pool_used - offset)) < 0)
+                goto too_long;
+        }
+    }
+    if (depth != 0) {
+        fprintf(stderr, "templates: '%s': unbalanced '[]'\n", t->name);
+        return -1;
+    }
+    return 0;
+too_long:
+    fprintf(stderr, "templates: '%s': too long\n", t->name);
+    return -1;
+}
+
+static int template_find(const char *name) {
+    for (int i = 0; i < cfg.template_count; i++)
+        if (strcmp(cfg.templates[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+static int template_parse(const char *name, const cJSON *item) {
+    if (cfg.template_count >= MAX_TEMPLATES) {
+        fprintf(stderr, "templates: '%s' not added, limit (%d) reached\n", name, MAX_TEMPLATES);
+        return 0;
+    }
+    template_t *t = &cfg.templates[cfg.template_count];
+    memset(t, 0, sizeof(*t));
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    strcpy(t->separator, "; ");
+    const char *s;
+    if ((s = cJSON_GetStringValue(item))) {
+        if (template_compile(t, &t->metar, s) < 0)
+            return -1;
+    } else {
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(item, "metar"))) && template_compile(t, &t->metar, s) < 0)
+            return -1;
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(item, "taf"))) && template_compile(t, &t->taf, s) < 0)
+            return -1;
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(item, "separator"))))
+            snprintf(t->separator, sizeof(t->separator), "%s", s);
+    }
+    debug("templates: '%s' compiled, %d+%d op(s), %d literal byte(s)", t->name, t->metar.count, t->taf.count, t->pool_used);
+    cfg.template_count++;
+    return 0;
+}
+
+static unsigned templates_select(const cJSON *names) {
+    unsigned mask = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, names) {
+        const char *name = cJSON_GetStringValue(item);
+        const int index = name ? template_find(name) : -1;
+        if (index < 0)
+            fprintf(stderr, "templates: '%s' not defined, ignored\n", name ? name : "(invalid)");
+        else
+            mask |= 1u << index;
+    }
+    return mask;
+}
+
+static void template_strip(char *out, const char *prefix) {
+    const size_t prefix_len = strlen(prefix);
+    if (strncmp(out, prefix, prefix_len) == 0)
+        memmove(out, out + prefix_len, strlen(out + prefix_len) + 1);
+    format_end(out, 0);
+}
+
+static void template_speed(char *out, size_t sz, const char *kt, template_field_t unit) {
+    const double v = atof(kt);
+    if (unit == FIELD_WIND_KT || unit == FIELD_GUST_KT)
+        snprintf(out, sz, "%d", atoi(kt));
+    else if (unit == FIELD_WIND_KMH || unit == FIELD_GUST_KMH)
+        snprintf(out, sz, "%ld", lround(v * 1.852));
+    else if (unit == FIELD_WIND_MS || unit == FIELD_GUST_MS)
+        snprintf(out, sz, "%ld", lround(v * 0.514444));
+    else
+        snprintf(out, sz, "%ld", lround(v * 1.15078));
+}
+
+static int template_ceiling(xmlNode *node) {
+    const char *vv = xml_text(node, "vert_vis_ft");
+    if (vv)
+        return atoi(vv);
+    int ceiling = -1;
+    for (xmlNode *n = node->children; n; n = n->next) {
+        if (n->type != XML_ELEMENT_NODE || strcmp((const char *)n->name, "sky_condition"))
+            continue;
+        const char *cover = xml_attr(n, "sky_cover"), *base = xml_attr(n, "cloud_base_ft_agl");
+        if (cover && base && (!strcmp(cover, "BKN") || !strcmp(cover, "OVC") || !strcmp(cover, "VV")) && (ceiling < 0 || atoi(base) < ceiling))
+            ceiling = atoi(base);
+    }
+    return ceiling;
+}
+
+static void template_clouds(char *out, size_t sz, xmlNode *node) {
+    const char *vv = xml_text(node, "vert_vis_ft");
+    if (vv) {
+        append(out, sz, "VV%03d", atoi(vv) / 100);
+        return;
+    }
+    for (xmlNode *n = node->children; n; n = n->next) {
+        if (n->type != XML_ELEMENT_NODE || strcmp((const char *)n->name, "sky_condition"))
+            continue;
+        const char *cover = xml_attr(n, "sky_cover");
+        if (!cover)
+            continue;
+        append(out, sz, "%s%s", *out ? " " : "", cover);
+        const char *base = xml_attr(n, "cloud_base_ft_agl");
+        if (base)
+            append(out, sz, "%03d", atoi(base) / 100);
+        const char *cloud_type = xml_attr(n, "cloud_type");
+        if (cloud_type)
+            append(out, sz, "%s", cloud_type);
+    }
+}
+
+// renders one field of the period being rendered, returns 0 if the report does not carry it
+static int template_field_render(const template_context_t *ctx, template_field_t field, char *out, size_t sz) {
+    xmlNode *node = ctx->node;
+    const char *v = NULL;
+    *out = '\0';
+    switch (field) {
+    case FIELD_ICAO:
+        snprintf(out, sz, "%s", ctx->ap->icao);
+        break;
+    case FIELD_NAME:
+        snprintf(out, sz, "%s", ctx->ap->name[0] ? ctx->ap->name : ctx->ap->icao);
+        break;
+    case FIELD_RAW:
+        if ((v = xml_text(ctx->report, "raw_text")))
+            snprintf(out, sz, "%s", v);
+        break;
+    case FIELD_TIME:
+        if ((v = xml_text(ctx->report, "observation_time")) || (v = xml_text(ctx->report, "issue_time")))
+            format_time(out, sz, v);
+        break;
+    case FIELD_FROM:
+    case FIELD_TO:
+        if ((v = xml_text(node, field == FIELD_FROM ? "fcst_time_from" : "fcst_time_to")))
+            format_time(out, sz, v);
+        break;
+    case FIELD_CHANGE:
+        if ((v = xml_text(node, "change_indicator")))
+            snprintf(out, sz, "%s", v);
+        break;
+    case FIELD_PROBABILITY:
+        if ((v = xml_text(node, "probability")))
+            snprintf(out, sz, "%d", atoi(v));
+        break;
+    case FIELD_WIND_DIR:
+        if ((v = xml_text(node, "wind_dir_degrees"))) {
+            const char *spd = xml_text(node, "wind_speed_kt");
+            if (atoi(v) == 0 && spd && atoi(spd) > 0)
+                snprintf(out, sz, "VRB");
+            else
+                snprintf(out, sz, "%03d", atoi(v));
+        }
+        break;
+    case FIELD_WIND_KT:
+    case FIELD_WIND_KMH:
+    case FIELD_WIND_MS:
+    case FIELD_WIND_MPH:
+        if ((v = xml_text(node, "wind_speed_kt")))
+            template_speed(out, sz, v, field);
+        break;
+    case FIELD_GUST_KT:
+    case FIELD_GUST_KMH:
+    case FIELD_GUST_MS:
+    case FIELD_GUST_MPH:
+        if ((v = xml_text(node, "wind_gust_kt")))
+            template_speed(out, sz, v, field);
+        break;
+    case FIELD_VIS_M:
+    case FIELD_VIS_KM:
+        if ((v = xml_text(node, "visibility_statute_mi"))) {
+            const double m = atof(v) * 1609.34;
+            if (field == FIELD_VIS_M)
+                snprintf(out, sz, "%d", m >= 9600 ? 9999 : (int)(m / 100 + 0.5) * 100);
+            else if (m >= 5000)
+                snprintf(out, sz, "%d", (int)(m / 1000 + 0.5));
+            else
+                snprintf(out, sz, "%.1f", m / 1000);
+        }
+        break;
+    case FIELD_VIS_SM:
+        if ((v = xml_text(node, "visibility_statute_mi")))
+            snprintf(out, sz, "%s", v);
+        break;
+    case FIELD_WX:
+        if ((v = xml_text(node, "wx_string")))
+            snprintf(out, sz, "%s", v);
+        break;
+    case FIELD_WEATHER:
+        format_wx(out, sz, node);
+        template_strip(out, "Weather ");
+        break;
+    case FIELD_CLOUDS:
+        template_clouds(out, sz, node);
+        break;
+    case FIELD_SKY:
+        format_sky(out, sz, node);
+        template_strip(out, "Sky ");
+        break;
+    case FIELD_CEILING_FT:
+    case FIELD_CEILING_M: {
+        const int ceiling = template_ceiling(node);
+        if (ceiling >= 0)
+            snprintf(out, sz, "%ld", field == FIELD_CEILING_FT ? (long)ceiling : lround(ceiling * 0.3048));
+        break;
+    }
+    case FIELD_TEMP_C:
+    case FIELD_TEMP_F:
+    case FIELD_DEWPOINT_C:
+    case FIELD_DEWPOINT_F:
+        if ((v = xml_text(node, field == FIELD_TEMP_C || field == FIELD_TEMP_F ? "temp_c" : "dewpoint_c"))) {
+            if (field == FIELD_TEMP_C || field == FIELD_DEWPOINT_C)
+                snprintf(out, sz, "%d", atoi(v));
+            else
+                snprintf(out, sz, "%ld", lround(atof(v) * 9 / 5 + 32));
+        }
+        break;
+    case FIELD_QNH_HPA:
+        if ((v = xml_text(node, "altim_in_hg")))
+            snprintf(out, sz, "%d", (int)(0.5 + 33.8639 * atof(v)));
+        break;
+    case FIELD_ALTIM_INHG:
+        if ((v = xml_text(node, "altim_in_hg")))
+            snprintf(out, sz, "%.2f", atof(v));
+        break;
+    case FIELD_CATEGORY:
+        if ((v = xml_text(node, "flight_category")))
+            snprintf(out, sz, "%s", v);
+        break;
+    case FIELD_COUNT:
+    default:
+        break;
+    }
+    return *out != '\0';
+}
+
+// each field is decoded at most once per period, however many templates use it
+static const char *template_value(template_context_t *ctx, template_field_t field) {
+    const uint64_t bit = 1ull << field;
+    if (!(ctx->resolved & bit)) {
+        char value[512];
+        ctx->resolved |= bit;
+        if (template_field_render(ctx, field, value, sizeof(value))) {
+            const size_t length = strlen(value) + 1;
+            if (ctx->used + length <= sizeof(ctx->values)) {
+                memcpy(ctx->values + ctx->used, value, length);
+                ctx->offsets[field] = (uint16_t)ctx->used;
+                ctx->used += length;
+                ctx->present |= bit;
+            }
+        }
+    }
+    return (ctx->present & bit) ? ctx->values + ctx->offsets[field] : NULL;
+}
+
+static void template_run(const template_t *t, const template_program_t *program, template_context_t *ctx, char *out, size_t sz) {
+    struct {
+        size_t length;
+        int missing;
+    } groups[MAX_TEMPLATE_DEPTH + 1];
+    int depth = 0;
+    groups[0].missing = 0;
+    for (int i = 0; i < program->count; i++) {
+        const template_op_t *op = &program->ops[i];
+        switch ((template_opcode_t)op->op) {
+        case TEMPLATE_OP_TEXT:
+            append(out, sz, "%.*s", (int)op->length, t->pool + op->offset);
+            break;
+        case TEMPLATE_OP_FIELD: {
+            const char *value = template_value(ctx, (template_field_t)op->field);
+            if (value)
+                append(out, sz, "%s", value);
+            else
+                groups[depth].missing = 1;
+            break;
+        }
+        case TEMPLATE_OP_OPEN:
+            depth++;
+            groups[depth].length = strlen(out);
+            groups[depth].missing = 0;
+            break;
+        case TEMPLATE_OP_CLOSE:
+            if (groups[depth].missing)
+                out[groups[depth].length] = '\0';
+            depth--;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void template_context_init(template_context_t *ctx, const airport_t *ap, xmlNode *report, xmlNode *node) {
+    ctx->ap = ap;
+    ctx->report = report;
+    ctx->node = node;
+    ctx->resolved = ctx->present = 0;
+    ctx->used = 0;
+}
+
+// renders every template selected for the airport into "texts": {name: text} on the report json
+// takes state_mutex: on-demand workers parse concurrently with a reload replacing cfg.templates
+static void templates_render(cJSON *json, const airport_t *ap, xmlNode *report, report_type_t type) {
+    if (!ap->templates)
+        return;
+    pthread_mutex_lock(&state_mutex);
+    template_context_t ctx;
+    char texts[MAX_TEMPLATES][MAX_TEMPLATE_TEXT];
+    for (int i = 0; i < cfg.template_count; i++)
+        texts[i][0] = '\0';
+    if (type == REPORT_METAR) {
+        template_context_init(&ctx, ap, report, report);
+        for (int i = 0; i < cfg.template_count; i++)
+            if (ap->templates & (1u << i))
+                template_run(&cfg.templates[i], &cfg.templates[i].metar, &ctx, texts[i], sizeof(texts[i]));
+    } else {
+        for (xmlNode *fc = report->children; fc; fc = fc->next)
+            if (fc->type == XML_ELEMENT_NODE && !strcmp((const char *)fc->name, "forecast")) {
+                template_context_init(&ctx, ap, report, fc);
+                for (int i = 0; i < cfg.template_count; i++)
+                    if (ap->templates & (1u << i) && cfg.templates[i].taf.count > 0) {
+                        if (texts[i][0])
+                            append(texts[i], sizeof(texts[i]), "%s", cfg.templates[i].separator);
+                        template_run(&cfg.templates[i], &cfg.templates[i].taf, &ctx, texts[i], sizeof(texts[i]));
+                    }
+            }
+    }
+    cJSON *object = NULL;
+    for (int i = 0; i < cfg.template_count; i++)
+        if ((ap->templates & (1u << i)) && texts[i][0]) {
+            if (!object)
+                object = cJSON_AddObjectToObject(json, "texts");
+            cJSON_AddStringToObject(object, cfg.templates[i].name, texts[i]);
+            debug("[%s] %s text '%s': %s", ap->icao, type == REPORT_METAR ? "METAR" : "TAF", cfg.templates[i].name, texts[i]);
+        }
+    pthread_mutex_unlock(&state_mutex);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+static void schedule_add_sample(schedule_t *sched, const char *icao, time_t issued) {
+    if (issued == 0)
+        return;
+    if (sched->sample_count >= LEARN_SAMPLES) {
+        memmove(&sched->samples[0], &sched->samples[1], (LEARN_SAMPLES - 1) * sizeof(time_t));
+        sched->sample_count = LEARN_SAMPLES - 1;
+    }
+    char stamp[32];
+    debug("[%s] add sample [%d]: %ld (%s)", icao, sched->sample_count, issued, timestamp_to_str(stamp, sizeof(stamp), issued)); // XXX
+    sched->samples[sched->sample_count++] = issued;
+}
+
+static int schedule_due(const schedule_t *sched, time_t now) {
+    return (sched->next_fetch == 0 || now >= sched->next_fetch) && now >= sched->retry_at;
+}
+
+static void schedule_failed(schedule_t *sched, const char *icao, const char *type, time_t now) {
+    sched->failures++;
+    if (sched->failures >= CIRCUIT_FAILURES) {
+        sched->retry_at = now + CIRCUIT_OPEN_SECONDS;
+        char stamp[32];
+        debug("[%s] %s circuit open after %d failures, probe at %s", icao, type, sched->failures, timestamp_to_str(stamp, sizeof(stamp), sched->retry_at));
+        return;
+    }
+    int backoff = BACKOFF_BASE_SECONDS << (sched->failures - 1);
+    if (backoff > BACKOFF_MAX_SECONDS)
+        backoff = BACKOFF_MAX_SECONDS;
+    backoff += (rand() % (backoff / 2 + 1)) - backoff / 4;
+    sched->retry_at = now + backoff;
+    debug("[%s] %s failure %d, retry in %d seconds", icao, type, sched->failures, backoff);
+}
+
+static void schedule_succeeded(schedule_t *sched, const char *icao, const char *type) {
+    if (sched->failures > 0)
+        debug("[%s] %s recovered after %d failures", icao, type, sched->failures);
+    sched->failures = 0;
+    sched->retry_at = 0;
+}
+
+static void schedule_spread(schedule_t *sched, time_t start, int offset) {
+    sched->next_fetch = start + offset;
+    sched->retry_at = 0;
+}
+
+static void schedule_add_missed(schedule_t *sched, const char *icao, const char *type) {
+    if (sched->sample_count > 2) {
+        debug("[%s] %s unexpected timing, reducing samples %d -> 2", icao, type, sched->sample_count);
+        sched->samples[0] = sched->samples[sched->sample_count - 2];
+        sched->samples[1] = sched->samples[sched->sample_count - 1];
+        sched->sample_count = 2;
+    }
+    sched->learned_period = 0;
+}
+
+static void schedule_learn(schedule_t *sched, const char *icao, const char *type) {
+    if (sched->sample_count < 2)
+        return;
+    int deltas[LEARN_SAMPLES - 1];
+    int delta_count = 0;
+    for (int i = 1; i < sched->sample_count; i++) {
         const int delta = (int)(sched->samples[i] - sched->samples[i - 1]);
         if (delta > 0)
             deltas[delta_count++] = delta;
@@ -643,24 +2027,44 @@ static void schedule_learn(schedule_t *sched, const char *icao, const char *type
         sched->learned_period = min_delta;
         debug("[%s] %s learned period: %d seconds (%d minutes)", icao, type, min_delta, min_delta / 60);
     }
-    const int cap_seconds = cap_minutes * 60;
-    if (sched->learned_period > cap_seconds) {
-        debug("[%s] %s period capped from %d to %d seconds", icao, type, sched->learned_period, cap_seconds);
-        sched->learned_period = cap_seconds;
-    }
 }
 
-static void schedule_update_next(schedule_t *sched, const char *icao, const char *type, int default_interval, int cap_minutes) {
-    const time_t now = time(NULL);
+// an unmarked report off the learned period; a run of them means the routine schedule itself moved, so they are let through
+// to be treated as missed again
+static int schedule_offcycle(schedule_t *sched, time_t issued) {
+    if (sched->learned_period <= 0 || sched->last_issued <= 0 || issued < sched->last_issued)
+        return 0;
+    const int remainder = (int)((issued - sched->last_issued) % sched->learned_period);
+    if (remainder <= OFFCYCLE_TOLERANCE_SECONDS || remainder >= sched->learned_period - OFFCYCLE_TOLERANCE_SECONDS)
+        return 0;
+    return ++sched->offcycle < OFFCYCLE_LIMIT;
+}
+
+// the cap bounds the gap between polls for every class (scaled with it), not the learned period: a 60 minute METAR period
+// stays 60 minutes for prediction while the station is still polled every cap in between (critical stations bound the
+// period for the missed check, see schedule_missed)
+static void schedule_update_next(schedule_t *sched, const char *icao, const char *type, int default_interval, int cap_minutes, priority_t priority, time_t now) {
+    const priority_class_t *pc = &priority_classes[priority];
+    const int cap = cap_minutes * 60 * pc->scale / 100;
     if (sched->learned_period > 0 && sched->last_issued > 0) {
-        time_t next = sched->last_issued + sched->learned_period;
-        while (next <= now)
-            next += sched->learned_period;
-        sched->next_fetch = next + SLACK_SECONDS;
-        debug("[%s] %s next fetch at %ld (%s) (in %ld seconds)", icao, type, sched->next_fetch, timestamp_to_str(sched->next_fetch), sched->next_fetch - now);
+        time_t expected = sched->last_issued + sched->learned_period;
+        if (priority == PRIORITY_CRITICAL) {
+            // burst from the predicted issuance until the report shows up or the window closes
+            while (expected + pc->slack <= now)
+                expected += sched->learned_period;
+            sched->next_fetch = expected > now ? expected : now + BURST_SECONDS;
+        } else {
+            while (expected <= now)
+                expected += sched->learned_period;
+            sched->next_fetch = expected + pc->slack;
+        }
+        // whatever the period, poll at least every cap so SPECIs are picked up
+        if (sched->next_fetch > now + cap)
+            sched->next_fetch = now + cap;
+        char stamp[32];
+        debug("[%s] %s next fetch at %ld (%s) (in %ld seconds)", icao, type, sched->next_fetch, timestamp_to_str(stamp, sizeof(stamp), sched->next_fetch), sched->next_fetch - now);
     } else {
-        const int cap = cap_minutes * 60;
-        int interval = default_interval * 60;
+        int interval = default_interval * 60 * pc->scale / 100;
         if (interval > cap)
             interval = cap;
         sched->next_fetch = now + interval;
@@ -668,6 +2072,212 @@ static void schedule_update_next(schedule_t *sched, const char *icao, const char
     }
 }
 
+// the report came out well before the fetch planned for it; a critical station's slack is its whole burst window, so it is
+// also checked against the learned period bounded by the class cap, or a stale period would go unnoticed for a whole period
+static int schedule_missed(const schedule_t *sched, time_t issued, int cap_minutes, priority_t priority) {
+    const priority_class_t *pc = &priority_classes[priority];
+    if (issued < sched->next_fetch - pc->slack)
+        return 1;
+    if (priority != PRIORITY_CRITICAL || sched->learned_period <= 0)
+        return 0;
+    const int cap = cap_minutes * 60 * pc->scale / 100;
+    const int period = sched->learned_period < cap ? sched->learned_period : cap;
+    return issued < sched->last_issued + period - OFFCYCLE_TOLERANCE_SECONDS;
+}
+
+// applies a successful fetch at 'now' returning the report issued at 'issued' ('special' if marked SPECI); shared by the daemon
+// and the simulator, returns 0 if the report is not new, else OBSERVE_ROUTINE or OBSERVE_SPECIAL; special reports are kept out
+// of the learned period
+static int schedule_observe(schedule_t *sched, const char *icao, const char *type, time_t issued, time_t now, int default_interval, int cap_minutes,
+                            priority_t priority, int special) {
+    int changed = 0;
+    if (opts.all) {
+        changed = special ? OBSERVE_SPECIAL : OBSERVE_ROUTINE;
+    } else if (issued == sched->last_issued || issued == sched->last_special) {
+        debug("[%s] %s unchanged", icao, type);
+    } else if (special || schedule_offcycle(sched, issued)) {
+        changed = OBSERVE_SPECIAL;
+        debug("[%s] %s %s: %ld", icao, type, special ? "special" : "off-cycle", issued);
+        sched->last_special = issued;
+    } else {
+        if (sched->last_issued != 0 && schedule_missed(sched, issued, cap_minutes, priority))
+            schedule_add_missed(sched, icao, type);
+        changed = OBSERVE_ROUTINE;
+        debug("[%s] %s changed: %ld -> %ld", icao, type, sched->last_issued, issued);
+        if (opts.learn) {
+            schedule_add_sample(sched, icao, issued);
+            schedule_learn(sched, icao, type);
+        }
+        sched->last_issued = issued;
+        sched->offcycle = 0;
+    }
+    if (opts.learn)
+        schedule_update_next(sched, icao, type, default_interval, cap_minutes, priority, now);
+    return changed;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+static int taf_has_sky(xmlNode *node) {
+    if (xml_text(node, "vert_vis_ft"))
+        return 1;
+    for (xmlNode *n = node->children; n; n = n->next)
+        if (n->type == XML_ELEMENT_NODE && !strcmp((const char *)n->name, "sky_condition"))
+            return 1;
+    return 0;
+}
+
+static void taf_conditions_apply(taf_conditions_t *cond, xmlNode *node, int replace) {
+    if (replace || xml_text(node, "wind_speed_kt"))
+        cond->wind = node;
+    if (replace || xml_text(node, "visibility_statute_mi"))
+        cond->vis = node;
+    if (replace || xml_text(node, "wx_string"))
+        cond->wx = node;
+    if (replace || taf_has_sky(node))
+        cond->sky = node;
+}
+
+static void taf_conditions_json(cJSON *json, const taf_conditions_t *cond) {
+    const char *v;
+    if (cond->wind && (v = xml_text(cond->wind, "wind_speed_kt"))) {
+        const char *dir = xml_text(cond->wind, "wind_dir_degrees");
+        if (dir && atoi(dir) == 0 && atoi(v) > 0)
+            cJSON_AddStringToObject(json, "wind_dir", "VRB");
+        else if (dir)
+            cJSON_AddNumberToObject(json, "wind_dir", atoi(dir));
+        cJSON_AddNumberToObject(json, "wind_speed_kt", atoi(v));
+        if ((v = xml_text(cond->wind, "wind_gust_kt")))
+            cJSON_AddNumberToObject(json, "wind_gust_kt", atoi(v));
+    }
+    if (cond->vis && (v = xml_text(cond->vis, "visibility_statute_mi")))
+        cJSON_AddStringToObject(json, "visibility_sm", v);
+    if (cond->wx && (v = xml_text(cond->wx, "wx_string")))
+        cJSON_AddStringToObject(json, "wx", v);
+    if (cond->sky) {
+        char clouds[256] = "";
+        template_clouds(clouds, sizeof(clouds), cond->sky);
+        if (clouds[0])
+            cJSON_AddStringToObject(json, "clouds", clouds);
+        const int ceiling = template_ceiling(cond->sky);
+        if (ceiling >= 0)
+            cJSON_AddNumberToObject(json, "ceiling_ft", ceiling);
+    }
+}
+
+static int taf_time_compare(const void *a, const void *b) {
+    const time_t ta = *(const time_t *)a, tb = *(const time_t *)b;
+    return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+// resolves the forecast groups into consecutive periods: FM replaces the prevailing conditions, BECMG changes those it gives from
+// its start, TEMPO and PROB are listed as "temporary" alternatives within the period they cover; identical neighbours are merged
+static cJSON *taf_timeline(xmlNode *taf) {
+    taf_group_t groups[MAX_TAF_GROUPS];
+    int group_count = 0;
+    const time_t valid_from = parse_iso_time(xml_text(taf, "valid_time_from")), valid_to = parse_iso_time(xml_text(taf, "valid_time_to"));
+    for (xmlNode *fc = taf->children; fc && group_count < MAX_TAF_GROUPS; fc = fc->next) {
+        if (fc->type != XML_ELEMENT_NODE || strcmp((const char *)fc->name, "forecast"))
+            continue;
+        taf_group_t *g = &groups[group_count++];
+        const char *change = xml_text(fc, "change_indicator"), *probability = xml_text(fc, "probability");
+        g->type = !change ? (group_count == 1 ? TAF_GROUP_INITIAL : TAF_GROUP_FM)
+                  : !strcmp(change, "FM")    ? TAF_GROUP_FM
+                  : !strcmp(change, "BECMG") ? TAF_GROUP_BECMG
+                  : !strcmp(change, "TEMPO") ? TAF_GROUP_TEMPO
+                                             : TAF_GROUP_PROB;
+        g->from = parse_iso_time(xml_text(fc, "fcst_time_from"));
+        g->to = parse_iso_time(xml_text(fc, "fcst_time_to"));
+        g->probability = probability ? atoi(probability) : 0;
+        g->node = fc;
+    }
+    if (!group_count || valid_to <= valid_from)
+        return NULL;
+
+    time_t bounds[MAX_TAF_GROUPS * 2 + 2];
+    int bound_count = 0;
+    bounds[bound_count++] = valid_from;
+    bounds[bound_count++] = valid_to;
+    for (int i = 0; i < group_count; i++) {
+        if (groups[i].from > valid_from && groups[i].from < valid_to)
+            bounds[bound_count++] = groups[i].from;
+        if (groups[i].type >= TAF_GROUP_BECMG && groups[i].to > valid_from && groups[i].to < valid_to)
+            bounds[bound_count++] = groups[i].to;
+    }
+    qsort(bounds, (size_t)bound_count, sizeof(time_t), taf_time_compare);
+
+    cJSON *timeline = cJSON_CreateArray(), *previous = NULL;
+    for (int b = 0; b + 1 < bound_count; b++) {
+        const time_t from = bounds[b], to = bounds[b + 1];
+        if (from == to)
+            continue;
+        // a BECMG group prevails once its transition is over; during the transition it is listed as an alternative
+        taf_conditions_t cond = {NULL, NULL, NULL, NULL};
+        for (int i = 0; i < group_count; i++) {
+            const time_t prevails = groups[i].type == TAF_GROUP_BECMG && groups[i].to > groups[i].from ? groups[i].to : groups[i].from;
+            if (groups[i].type <= TAF_GROUP_BECMG && (groups[i].type == TAF_GROUP_INITIAL || prevails <= from))
+                taf_conditions_apply(&cond, groups[i].node, groups[i].type != TAF_GROUP_BECMG);
+        }
+        cJSON *period = cJSON_CreateObject();
+        taf_conditions_json(period, &cond);
+        cJSON *temporary = NULL;
+        for (int i = 0; i < group_count; i++) {
+            if (groups[i].type < TAF_GROUP_BECMG || groups[i].from > from || groups[i].to <= from)
+                continue;
+            if (!temporary)
+                temporary = cJSON_AddArrayToObject(period, "temporary");
+            cJSON *alternative = cJSON_CreateObject();
+            cJSON_AddStringToObject(alternative, "change", xml_text(groups[i].node, "change_indicator"));
+            if (groups[i].probability)
+                cJSON_AddNumberToObject(alternative, "probability", groups[i].probability);
+            taf_conditions_t overlay = {NULL, NULL, NULL, NULL};
+            taf_conditions_apply(&overlay, groups[i].node, 0);
+            taf_conditions_json(alternative, &overlay);
+            cJSON_AddItemToArray(temporary, alternative);
+        }
+        char from_str[32], to_str[32];
+        timestamp_to_str(from_str, sizeof(from_str), from);
+        timestamp_to_str(to_str, sizeof(to_str), to);
+        if (previous && cJSON_Compare(cJSON_GetObjectItem(previous, "conditions"), period, 1)) {
+            cJSON_ReplaceItemInObject(previous, "to", cJSON_CreateString(to_str));
+            cJSON_Delete(period);
+            continue;
+        }
+        cJSON *entry = cJSON_CreateObject();
+        cJSON_AddStringToObject(entry, "from", from_str);
+        cJSON_AddStringToObject(entry, "to", to_str);
+        cJSON_AddItemToObject(entry, "conditions", period);
+        cJSON_AddItemToArray(timeline, entry);
+        previous = entry;
+    }
+    return timeline;
+}
+
+// the period in force at t and the one after it
+static cJSON *taf_effective(const cJSON *timeline, time_t t, time_t *changes) {
+    cJSON *effective = cJSON_CreateObject();
+    char at[32];
+    timestamp_to_str(at, sizeof(at), t);
+    cJSON_AddStringToObject(effective, "at", at);
+    const cJSON *entry, *now = NULL, *next = NULL;
+    cJSON_ArrayForEach(entry, timeline) {
+        const time_t from = parse_iso_time(cJSON_GetStringValue(cJSON_GetObjectItem(entry, "from")));
+        const time_t to = parse_iso_time(cJSON_GetStringValue(cJSON_GetObjectItem(entry, "to")));
+        if (from <= t && t < to)
+            now = entry;
+        else if (from > t && !next)
+            next = entry;
+    }
+    cJSON_AddItemToObject(effective, "now", now ? cJSON_Duplicate(now, 1) : cJSON_CreateNull());
+    cJSON_AddItemToObject(effective, "next", next ? cJSON_Duplicate(next, 1) : cJSON_CreateNull());
+    if (changes)
+        *changes = next ? parse_iso_time(cJSON_GetStringValue(cJSON_GetObjectItem(next, "from")))
+                   : now ? parse_iso_time(cJSON_GetStringValue(cJSON_GetObjectItem(now, "to")))
+                         : 0;
+    return effective;
+}
+
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
 static cJSON *process_metar(const char *xml_data, const airport_t *ap, time_t *out_observed) {
@@ -684,6 +2294,10 @@ static cJSON *process_metar(const char *xml_data, const airport_t *ap, time_t *o
 
     char text[2048] = "";
 
+    const char *raw = xml_text(metar, "raw_text");
+    const char *metar_type = xml_text(metar, "metar_type");
+    const int speci = (metar_type && !strcmp(metar_type, "SPECI")) || (raw && !strncmp(raw, "SPECI ", 6));
+
     char timestr[64] = "";
     const char *observed = xml_text(metar, "observation_time");
     if (observed)
@@ -693,9 +2307,9 @@ static cJSON *process_metar(const char *xml_data, const airport_t *ap, time_t *o
 
     if (opts.header) {
         if (ap->name[0])
-            append(text, sizeof(text), "METAR for %s (%s) issued %s", ap->name, ap->icao, timestr);
+            append(text, sizeof(text), "%s for %s (%s) issued %s", speci ? "SPECI" : "METAR", ap->name, ap->icao, timestr);
         else
-            append(text, sizeof(text), "METAR for %s issued %s", ap->icao, timestr);
+            append(text, sizeof(text), "%s for %s issued %s", speci ? "SPECI" : "METAR", ap->icao, timestr);
     } else {
         append(text, sizeof(text), "issued %s", timestr);
     }
@@ -710,7 +2324,6 @@ static cJSON *process_metar(const char *xml_data, const airport_t *ap, time_t *o
     format_category(text, sizeof(text), metar);
     format_end(text, sizeof(text));
 
-    const char *raw = xml_text(metar, "raw_text");
     debug("[%s] METAR raw: %s", ap->icao, raw ? raw : "(none)");
     debug("[%s] METAR text: %s", ap->icao, text);
 
@@ -720,11 +2333,14 @@ static cJSON *process_metar(const char *xml_data, const airport_t *ap, time_t *o
     if (raw)
         cJSON_AddStringToObject(json, "raw", raw);
     cJSON_AddStringToObject(json, "text", text);
+    if (speci)
+        cJSON_AddBoolToObject(json, "speci", 1);
+    templates_render(json, ap, metar, REPORT_METAR);
     xmlFreeDoc(doc);
     return json;
 }
 
-static cJSON *process_taf(const char *xml_data, const airport_t *ap, time_t *out_issued) {
+static cJSON *process_taf(const char *xml_data, const airport_t *ap, time_t *out_issued, time_t *out_valid_to) {
     xmlDoc *doc = xmlReadMemory(xml_data, (int)strlen(xml_data), NULL, NULL, 0);
     if (!doc)
         return NULL;
@@ -744,6 +2360,8 @@ static cJSON *process_taf(const char *xml_data, const airport_t *ap, time_t *out
         format_time(t1, sizeof(t1), issued);
     if (out_issued)
         *out_issued = parse_iso_time(issued);
+    if (out_valid_to)
+        *out_valid_to = parse_iso_time(xml_text(taf, "valid_time_to"));
 #if 0
     char t2[64] = "", t3[64] = "";
     const char *valid_from = xml_text(taf, "valid_time_from");
@@ -793,6 +2411,12 @@ static cJSON *process_taf(const char *xml_data, const airport_t *ap, time_t *out
     if (raw)
         cJSON_AddStringToObject(json, "raw", raw);
     cJSON_AddStringToObject(json, "text", text);
+    templates_render(json, ap, taf, REPORT_TAF);
+    cJSON *timeline = taf_timeline(taf);
+    if (timeline) {
+        cJSON_AddItemToObject(json, "timeline", timeline);
+        cJSON_AddItemToObject(json, "effective", taf_effective(timeline, time(NULL), NULL));
+    }
     xmlFreeDoc(doc);
     return json;
 }
@@ -800,150 +2424,1780 @@ static cJSON *process_taf(const char *xml_data, const airport_t *ap, time_t *out
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-static void publish_payload(const airport_t *ap, const cJSON *root, const char *suffix) {
-    char topic[MAX_TOPIC];
-    snprintf(topic, sizeof(topic), "%s/%s%s%s", cfg.topic_prefix, ap->icao, suffix ? "/" : "", suffix ? suffix : "");
-    debug("publish: %s to %s\n", ap->icao, topic);
-    char *payload = cJSON_PrintUnformatted(root);
-    mosquitto_publish(mosq, NULL, topic, (int)strlen(payload), payload, 0, true);
-    free(payload);
-}
-static void publish_type(airport_t *ap, const char *timestamp, const cJSON *object, const char *name) {
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "timestamp", timestamp);
-    cJSON_AddItemToObject(root, "airport", cJSON_Duplicate(ap->json, 1));
-    cJSON_AddItemToObject(root, name, cJSON_Duplicate(object, 1));
-    publish_payload(ap, root, name);
-    cJSON_Delete(root);
-}
-static void publish_split(airport_t *ap, const char *timestamp, const cJSON *metar, int metar_changed, const cJSON *taf, int taf_changed) {
-    if (metar && metar_changed)
-        publish_type(ap, timestamp, metar, "metar");
-    if (taf && taf_changed)
-        publish_type(ap, timestamp, taf, "taf");
+static uint32_t hash_str(const char *str) {
+    uint32_t hash = 2166136261u;
+    while (*str)
+        hash = (hash ^ (uint8_t)*str++) * 16777619u;
+    return hash;
 }
 
-static void publish_combined(airport_t *ap, const char *timestamp, const cJSON *metar, const cJSON *taf) {
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "timestamp", timestamp);
-    cJSON_AddItemToObject(root, "airport", cJSON_Duplicate(ap->json, 1));
-    if (metar)
-        cJSON_AddItemToObject(root, "metar", cJSON_Duplicate(metar, 1));
-    if (taf)
-        cJSON_AddItemToObject(root, "taf", cJSON_Duplicate(taf, 1));
-    publish_payload(ap, root, NULL);
-    cJSON_Delete(root);
+static interned_t *intern_get(const char *str) {
+    const uint32_t hash = hash_str(str);
+    interned_t **bucket = &intern_buckets[hash % INTERN_BUCKETS];
+    for (interned_t *in = *bucket; in; in = in->next)
+        if (in->hash == hash && strcmp(in->str, str) == 0) {
+            in->refs++;
+            return in;
+        }
+    const size_t len = strlen(str);
+    interned_t *in = malloc(sizeof(interned_t) + len + 1);
+    if (!in)
+        return NULL;
+    in->hash = hash;
+    in->refs = 1;
+    memcpy(in->str, str, len + 1);
+    in->next = *bucket;
+    *bucket = in;
+    return in;
 }
 
-static void fetch_and_publish(airport_t *ap) {
-    char timestamp[32];
-    const time_t now = time(NULL);
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
-
-    cJSON *metar = NULL, *taf = NULL;
-    int metar_changed = 0, taf_changed = 0;
-    time_t observed = 0, issued = 0;
-
-    if (ap->fetch_metar && (ap->sched_metar.next_fetch == 0 || now >= ap->sched_metar.next_fetch)) {
-        char url[MAX_URL];
-        snprintf(url, sizeof(url), "https://aviationweather.gov/api/data/metar?format=xml&taf=false&ids=%s", ap->icao);
-        char *xml = fetch_url(url);
-        if (xml) {
-            metar = process_metar(xml, ap, &observed);
-            free(xml);
-        }
-        if (metar) {
-            if (opts.all) {
-                metar_changed = 1;
-            } else if (observed != ap->sched_metar.last_issued) {
-                if (ap->sched_metar.last_issued != 0 && observed < ap->sched_metar.next_fetch - SLACK_SECONDS)
-                    schedule_add_missed(&ap->sched_metar, ap->icao, "METAR");
-                metar_changed = 1;
-                debug("[%s] METAR changed: %ld -> %ld", ap->icao, ap->sched_metar.last_issued, observed);
-                if (opts.learn) {
-                    schedule_add_sample(&ap->sched_metar, ap->icao, observed);
-                    schedule_learn(&ap->sched_metar, ap->icao, "METAR", METAR_CAP_MINUTES);
-                }
-                ap->sched_metar.last_issued = observed;
-            } else {
-                debug("[%s] METAR unchanged", ap->icao);
-            }
-            if (opts.learn)
-                schedule_update_next(&ap->sched_metar, ap->icao, "METAR", ap->interval, METAR_CAP_MINUTES);
+static void intern_release(interned_t *in) {
+    if (!in || --in->refs > 0)
+        return;
+    for (interned_t **p = &intern_buckets[in->hash % INTERN_BUCKETS]; *p; p = &(*p)->next)
+        if (*p == in) {
+            *p = in->next;
+            break;
         }
-    }
+    free(in);
+}
 
-    if (ap->fetch_taf && (ap->sched_taf.next_fetch == 0 || now >= ap->sched_taf.next_fetch)) {
-        char url[MAX_URL];
-        snprintf(url, sizeof(url), "https://aviationweather.gov/api/data/taf?format=xml&ids=%s", ap->icao);
-        char *xml = fetch_url(url);
-        if (xml) {
-            taf = process_taf(xml, ap, &issued);
-            free(xml);
-        }
-        if (taf) {
-            if (opts.all) {
-                taf_changed = 1;
-            } else if (issued != ap->sched_taf.last_issued) {
-                if (ap->sched_taf.last_issued != 0 && issued < ap->sched_taf.next_fetch - SLACK_SECONDS)
-                    schedule_add_missed(&ap->sched_taf, ap->icao, "TAF");
-                taf_changed = 1;
-                debug("[%s] TAF changed: %ld -> %ld", ap->icao, ap->sched_taf.last_issued, issued);
-                if (opts.learn) {
-                    schedule_add_sample(&ap->sched_taf, ap->icao, issued);
-                    schedule_learn(&ap->sched_taf, ap->icao, "TAF", TAF_CAP_MINUTES);
-                }
-                ap->sched_taf.last_issued = issued;
-            } else {
-                debug("[%s] TAF unchanged", ap->icao);
+static const char *report_type_str(report_type_t type) {
+    return type == REPORT_TAF ? "taf" : "metar";
+}
+
+static void history_add(airport_t *ap, report_type_t type, time_t t, const cJSON *report) {
+    if (cfg.history_depth <= 0 || t == 0)
+        return;
+    const char *raw = cJSON_GetStringValue(cJSON_GetObjectItem(report, "raw"));
+    const char *text = cJSON_GetStringValue(cJSON_GetObjectItem(report, "text"));
+    pthread_mutex_lock(&state_mutex);
+    history_t *h = &ap->history;
+    for (int i = 0; i < h->count; i++) {
+        const history_record_t *r = &h->records[(h->head + cfg.history_depth - 1 - i) % cfg.history_depth];
+        if (r->type == type) {
+            if (r->time == t) {
+                pthread_mutex_unlock(&state_mutex);
+                return;
             }
-            if (opts.learn)
-                schedule_update_next(&ap->sched_taf, ap->icao, "TAF", ap->interval, TAF_CAP_MINUTES);
+            break;
         }
     }
-
-    if (opts.split) {
-        publish_split(ap, timestamp, metar, metar_changed, taf, taf_changed);
-    } else {
-        if (metar_changed || taf_changed)
-            publish_combined(ap, timestamp, metar, taf);
-        else
-            debug("[%s] nothing to publish", ap->icao);
-    }
-
-    if (metar)
-        cJSON_Delete(metar);
-    if (taf)
-        cJSON_Delete(taf);
-    ap->last_fetch = now;
+    history_record_t *r = &h->records[h->head];
+    if (h->count == cfg.history_depth) {
+        intern_release(r->raw);
+        intern_release(r->text);
+    } else
+        h->count++;
+    r->time = t;
+    r->type = type;
+    r->raw = raw ? intern_get(raw) : NULL;
+    r->text = text ? intern_get(text) : NULL;
+    h->head = (h->head + 1) % cfg.history_depth;
+    pthread_mutex_unlock(&state_mutex);
+    char stamp[32];
+    debug("[%s] history: recorded %s %s (%d held)", ap->icao, report_type_str(type), timestamp_to_str(stamp, sizeof(stamp), t), h->count);
 }
 
-static int should_fetch(const airport_t *ap) {
-    const time_t now = time(NULL);
-    if (opts.all)
-        return (now - ap->last_fetch >= ap->interval * 60);
-    if (ap->fetch_metar && (ap->sched_metar.next_fetch == 0 || now >= ap->sched_metar.next_fetch))
-        return 1;
-    if (ap->fetch_taf && (ap->sched_taf.next_fetch == 0 || now >= ap->sched_taf.next_fetch))
-        return 1;
-    return 0;
+static void history_free(airport_t *ap) {
+    history_t *h = &ap->history;
+    for (int i = 0; i < h->count; i++) {
+        intern_release(h->records[i].raw);
+        intern_release(h->records[i].text);
+    }
+    h->count = h->head = 0;
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-static int config_load(const char *path) {
-    char *data = read_file(path, "config");
-    if (!data)
-        return -1;
-    cJSON *json = cJSON_Parse(data);
-    free(data);
-    if (!json) {
-        fprintf(stderr, "config: parse error\n");
-        return -1;
-    }
+// archive segment: 8 byte header ("AVWA", version, 3 reserved), then append-only blocks, each self-contained and columnar:
+//   header: "AVWB", u32 payload length, u32 record count, u32 new dictionary entries, i64 base time (all little-endian)
+//   payload: dictionary entries (u8 length + ICAO), ICAO ids (varint), types (u8), times (zigzag varint delta from previous),
+//            raw lengths (varint), raw bytes (concatenated)
 
-    cJSON *mqtt = cJSON_GetObjectItem(json, "mqtt");
+static void put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+static void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+static uint32_t get_u32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++)
+        v |= (uint32_t)p[i] << (8 * i);
+    return v;
+}
+static uint64_t get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+static size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        const uint8_t b = *p++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return p;
+    }
+    return NULL;
+}
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int archive_dict_id(archive_dict_t *dict, const char *icao) {
+    for (int i = 0; i < dict->count; i++)
+        if (strcmp(dict->icaos[i], icao) == 0)
+            return i;
+    if (dict->count >= ARCHIVE_DICT_MAX)
+        return -1;
+    snprintf(dict->icaos[dict->count], MAX_ICAO, "%s", icao);
+    return dict->count++;
+}
+
+typedef void (*archive_record_cb)(time_t t, const char *icao, report_type_t type, const char *raw, size_t raw_len, void *userdata);
+
+// returns the length of the valid prefix (complete blocks), or -1 if the file is not a segment
+static long archive_scan(const char *path, archive_dict_t *dict, archive_record_cb cb, void *userdata) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < ARCHIVE_SEGMENT_HEADER) {
+        close(fd);
+        return -1;
+    }
+    const size_t size = (size_t)st.st_size;
+    uint8_t *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+    if (memcmp(base, ARCHIVE_MAGIC_SEGMENT, 4) != 0 || base[4] != ARCHIVE_VERSION) {
+        munmap(base, size);
+        return -1;
+    }
+    dict->count = 0;
+    size_t offset = ARCHIVE_SEGMENT_HEADER;
+    uint64_t *ids = NULL, *lens = NULL;
+    time_t *times = NULL;
+    while (offset + ARCHIVE_BLOCK_HEADER <= size) {
+        const uint8_t *h = base + offset;
+        if (memcmp(h, ARCHIVE_MAGIC_BLOCK, 4) != 0)
+            break;
+        const uint32_t length = get_u32(h + 4), count = get_u32(h + 8), dict_count = get_u32(h + 12);
+        time_t t = (time_t)get_u64(h + 16);
+        const uint8_t *p = h + ARCHIVE_BLOCK_HEADER, *end = p + length;
+        if (offset + ARCHIVE_BLOCK_HEADER + length > size || count > length)
+            break;
+        for (uint32_t i = 0; i < dict_count && p && p < end; i++) {
+            const uint8_t len = *p++;
+            if (p + len > end || dict->count >= ARCHIVE_DICT_MAX) {
+                p = NULL;
+                break;
+            }
+            const size_t copy = len < MAX_ICAO ? len : MAX_ICAO - 1;
+            memcpy(dict->icaos[dict->count], p, copy);
+            dict->icaos[dict->count++][copy] = 0;
+            p += len;
+        }
+        uint64_t *new_ids = realloc(ids, sizeof(uint64_t) * (count + 1));
+        if (new_ids)
+            ids = new_ids;
+        uint64_t *new_lens = realloc(lens, sizeof(uint64_t) * (count + 1));
+        if (new_lens)
+            lens = new_lens;
+        time_t *new_times = realloc(times, sizeof(time_t) * (count + 1));
+        if (new_times)
+            times = new_times;
+        if (!new_ids || !new_lens || !new_times)
+            break;
+        for (uint32_t i = 0; i < count && p; i++)
+            p = get_varint(p, end, &ids[i]);
+        const uint8_t *types = p;
+        if (p)
+            p = p + count <= end ? p + count : NULL;
+        for (uint32_t i = 0; i < count && p; i++) {
+            uint64_t delta;
+            p = get_varint(p, end, &delta);
+            times[i] = t = t + (time_t)unzigzag(delta);
+        }
+        for (uint32_t i = 0; i < count && p; i++)
+            p = get_varint(p, end, &lens[i]);
+        if (!p)
+            break;
+        if (cb)
+            for (uint32_t i = 0; i < count; i++) {
+                if (p + lens[i] > end || ids[i] >= (uint64_t)dict->count)
+                    break;
+                cb(times[i], dict->icaos[ids[i]], types[i] == REPORT_TAF ? REPORT_TAF : REPORT_METAR, (const char *)p, (size_t)lens[i], userdata);
+                p += lens[i];
+            }
+        offset += ARCHIVE_BLOCK_HEADER + length;
+    }
+    free(ids);
+    free(lens);
+    free(times);
+    munmap(base, size);
+    return (long)offset;
+}
+
+static void archive_dump_cb(time_t t, const char *icao, report_type_t type, const char *raw, size_t raw_len, void *userdata) {
+    (void)userdata;
+    char stamp[32];
+    printf("%s %s %s %.*s\n", timestamp_to_str(stamp, sizeof(stamp), t), icao, report_type_str(type), (int)raw_len, raw);
+}
+
+static int archive_dump(const char *path) {
+    static archive_dict_t dict;
+    if (archive_scan(path, &dict, archive_dump_cb, NULL) < 0) {
+        fprintf(stderr, "archive: not a segment file: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int archive_open(const char *day) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.avwa", cfg.archive_directory, day);
+    const long valid = archive_scan(path, &archive.dict, NULL, NULL);
+    archive.fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (archive.fd < 0) {
+        fprintf(stderr, "archive: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (valid < 0) {
+        uint8_t header[ARCHIVE_SEGMENT_HEADER] = {0};
+        memcpy(header, ARCHIVE_MAGIC_SEGMENT, 4);
+        header[4] = ARCHIVE_VERSION;
+        archive.dict.count = 0;
+        if (ftruncate(archive.fd, 0) < 0 || write(archive.fd, header, sizeof(header)) != (ssize_t)sizeof(header)) {
+            fprintf(stderr, "archive: cannot initialise %s: %s\n", path, strerror(errno));
+            close(archive.fd);
+            archive.fd = -1;
+            return -1;
+        }
+    } else if (ftruncate(archive.fd, valid) < 0 || lseek(archive.fd, valid, SEEK_SET) < 0) {
+        fprintf(stderr, "archive: cannot position %s: %s\n", path, strerror(errno));
+        close(archive.fd);
+        archive.fd = -1;
+        return -1;
+    }
+    archive.dict_written = archive.dict.count;
+    snprintf(archive.day, sizeof(archive.day), "%s", day);
+    debug("archive: opened %s (%ld bytes, %d icao(s))", path, valid < 0 ? (long)ARCHIVE_SEGMENT_HEADER : valid, archive.dict.count);
+    return 0;
+}
+
+static void archive_discard(void) {
+    if (archive.pending_count > 0)
+        fprintf(stderr, "archive: dropping %d record(s)\n", archive.pending_count);
+    for (int i = 0; i < archive.pending_count; i++)
+        free(archive.pending[i].raw);
+    archive.pending_count = 0;
+    archive.dict.count = archive.dict_written;
+}
+
+// on a write error the records stay pending for the next flush (they are past last_archived, nothing adds them again) until
+// the batch is full
+static void archive_flush(void) {
+    if (archive.pending_count == 0 || archive.fd < 0)
+        return;
+    size_t size = ARCHIVE_BLOCK_HEADER;
+    for (int i = archive.dict_written; i < archive.dict.count; i++)
+        size += 1 + MAX_ICAO;
+    for (int i = 0; i < archive.pending_count; i++)
+        size += 10 + 1 + 10 + 10 + strlen(archive.pending[i].raw);
+    uint8_t *block = malloc(size);
+    if (!block) {
+        fprintf(stderr, "archive: cannot allocate %zu byte block\n", size);
+        archive_discard();
+        return;
+    }
+    const time_t base = archive.pending[0].time;
+    size_t n = ARCHIVE_BLOCK_HEADER;
+    for (int i = archive.dict_written; i < archive.dict.count; i++) {
+        const size_t len = strlen(archive.dict.icaos[i]);
+        block[n++] = (uint8_t)len;
+        memcpy(block + n, archive.dict.icaos[i], len);
+        n += len;
+    }
+    for (int i = 0; i < archive.pending_count; i++)
+        n += put_varint(block + n, (uint64_t)archive.pending[i].icao);
+    for (int i = 0; i < archive.pending_count; i++)
+        block[n++] = (uint8_t)archive.pending[i].type;
+    time_t previous = base;
+    for (int i = 0; i < archive.pending_count; i++) {
+        n += put_varint(block + n, zigzag((int64_t)(archive.pending[i].time - previous)));
+        previous = archive.pending[i].time;
+    }
+    for (int i = 0; i < archive.pending_count; i++)
+        n += put_varint(block + n, strlen(archive.pending[i].raw));
+    for (int i = 0; i < archive.pending_count; i++) {
+        const size_t len = strlen(archive.pending[i].raw);
+        memcpy(block + n, archive.pending[i].raw, len);
+        n += len;
+    }
+    memcpy(block, ARCHIVE_MAGIC_BLOCK, 4);
+    put_u32(block + 4, (uint32_t)(n - ARCHIVE_BLOCK_HEADER));
+    put_u32(block + 8, (uint32_t)archive.pending_count);
+    put_u32(block + 12, (uint32_t)(archive.dict.count - archive.dict_written));
+    put_u64(block + 16, (uint64_t)base);
+    const off_t start = lseek(archive.fd, 0, SEEK_CUR);
+    if (write(archive.fd, block, n) != (ssize_t)n || fdatasync(archive.fd) < 0) {
+        fprintf(stderr, "archive: write failed: %s\n", strerror(errno));
+        if (start >= 0 && ftruncate(archive.fd, start) == 0)
+            lseek(archive.fd, start, SEEK_SET);
+        free(block);
+        if (archive.pending_count >= ARCHIVE_BATCH_MAX)
+            archive_discard();
+        return;
+    }
+    debug("archive: wrote block of %d record(s), %zu bytes", archive.pending_count, n);
+    archive.dict_written = archive.dict.count;
+    free(block);
+    for (int i = 0; i < archive.pending_count; i++)
+        free(archive.pending[i].raw);
+    archive.pending_count = 0;
+}
+
+static void archive_add(const airport_t *ap, report_type_t type, time_t t, const cJSON *report) {
+    const char *raw = cJSON_GetStringValue(cJSON_GetObjectItem(report, "raw"));
+    if (!cfg.archive_directory[0] || t == 0 || !raw)
+        return;
+    const time_t now = time(NULL);
+    char day[16];
+    struct tm tm;
+    strftime(day, sizeof(day), "%Y%m%d", gmtime_r(&now, &tm));
+    if (archive.fd < 0 || strcmp(day, archive.day) != 0) {
+        archive_flush();
+        archive_discard(); // still pending after a failed flush, their ICAO ids belong to the old segment's dictionary
+        if (archive.fd >= 0)
+            close(archive.fd);
+        archive.fd = -1;
+        if (archive_open(day) < 0)
+            return;
+    }
+    if (archive.pending_count >= ARCHIVE_BATCH_MAX)
+        archive_flush();
+    if (archive.pending_count >= ARCHIVE_BATCH_MAX)
+        return;
+    const int icao = archive_dict_id(&archive.dict, ap->icao);
+    if (icao < 0)
+        return;
+    archive_record_t *r = &archive.pending[archive.pending_count];
+    if (!(r->raw = strdup(raw)))
+        return;
+    r->time = t;
+    r->icao = icao;
+    r->type = type;
+    if (archive.pending_count++ == 0)
+        archive.pending_since = now;
+    if (archive.pending_count >= cfg.archive_flush_records || archive.pending_count >= ARCHIVE_BATCH_MAX)
+        archive_flush();
+}
+
+static void archive_tick(void) {
+    if (archive.pending_count > 0 && time(NULL) - archive.pending_since >= cfg.archive_flush_seconds)
+        archive_flush();
+}
+
+static void archive_close(void) {
+    archive_flush();
+    archive_discard();
+    if (archive.fd >= 0)
+        close(archive.fd);
+    archive.fd = -1;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+static int shm_feed_open(void) {
+    const int fd = shm_open(cfg.shm_name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "shm: cannot open %s: %s\n", cfg.shm_name, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(avw_shm_t)) < 0) {
+        fprintf(stderr, "shm: cannot size %s: %s\n", cfg.shm_name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, sizeof(avw_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "shm: cannot map %s: %s\n", cfg.shm_name, strerror(errno));
+        return -1;
+    }
+    shm_feed = (avw_shm_t *)base;
+    atomic_store_explicit(&shm_feed->magic, 0, memory_order_relaxed);
+    memset((char *)shm_feed + sizeof(shm_feed->magic), 0, sizeof(avw_shm_t) - sizeof(shm_feed->magic));
+    shm_feed->version = AVW_SHM_VERSION;
+    shm_feed->slot_count = AVW_SHM_SLOTS;
+    shm_feed->event_count = AVW_SHM_EVENTS;
+    atomic_store_explicit(&shm_feed->magic, AVW_SHM_MAGIC, memory_order_release);
+    debug("shm: feed at %s (%zu bytes)", cfg.shm_name, sizeof(avw_shm_t));
+    return 0;
+}
+
+static void shm_feed_write(const airport_t *ap, report_type_t type, time_t t, const cJSON *report) {
+    if (!shm_feed || t == 0)
+        return;
+    int index = -1;
+    for (int i = 0; i < AVW_SHM_SLOTS && index < 0; i++) {
+        const avw_shm_slot_t *slot = &shm_feed->slots[i];
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == 0 || (slot->type == (uint32_t)type && strncmp(slot->icao, ap->icao, AVW_SHM_ICAO) == 0))
+            index = i;
+    }
+    if (index < 0) {
+        debug("[%s] shm: no free slot", ap->icao);
+        return;
+    }
+    const char *raw = cJSON_GetStringValue(cJSON_GetObjectItem(report, "raw"));
+    const char *text = cJSON_GetStringValue(cJSON_GetObjectItem(report, "text"));
+    avw_shm_slot_t *slot = &shm_feed->slots[index];
+    const uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->type = (uint32_t)type;
+    snprintf(slot->icao, sizeof(slot->icao), "%s", ap->icao);
+    slot->time = (int64_t)t;
+    slot->updated = (int64_t)time(NULL);
+    slot->flags = cJSON_IsTrue(cJSON_GetObjectItem(report, "off_cycle")) ? AVW_SHM_FLAG_OFF_CYCLE : 0;
+    snprintf(slot->raw, sizeof(slot->raw), "%s", raw ? raw : "");
+    snprintf(slot->text, sizeof(slot->text), "%s", text ? text : "");
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+
+    const uint64_t head = atomic_load_explicit(&shm_feed->event_head, memory_order_relaxed);
+    avw_shm_event_t *ev = &shm_feed->events[head % AVW_SHM_EVENTS];
+    atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    ev->slot = (uint32_t)index;
+    ev->slot_seq = seq + 2;
+    atomic_store_explicit(&ev->seq, head + 1, memory_order_release);
+    atomic_store_explicit(&shm_feed->event_head, head + 1, memory_order_release);
+}
+
+static void shm_feed_close(void) {
+    if (!shm_feed)
+        return;
+    munmap((void *)shm_feed, sizeof(avw_shm_t));
+    shm_unlink(cfg.shm_name);
+    shm_feed = NULL;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+#ifdef WITH_ZSTD
+static uint8_t *compress_read(const char *path, size_t *size) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    uint8_t *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (data = malloc((size_t)st.st_size))) {
+        *size = (size_t)st.st_size;
+        if (read(fd, data, *size) != (ssize_t)*size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    close(fd);
+    return data;
+}
+#endif
+
+static int compress_open(void) {
+    if (!cfg.compress_dictionary[0])
+        return 0;
+#ifdef WITH_ZSTD
+    size_t size = 0;
+    uint8_t *dictionary = compress_read(cfg.compress_dictionary, &size);
+    if (!dictionary) {
+        fprintf(stderr, "compression: cannot read dictionary %s: %s\n", cfg.compress_dictionary, strerror(errno));
+        return -1;
+    }
+    compress.cdict = ZSTD_createCDict(dictionary, size, cfg.compress_level);
+    compress.ddict = ZSTD_createDDict(dictionary, size);
+    compress.dict_id = ZSTD_getDictID_fromDict(dictionary, size);
+    free(dictionary);
+    compress.cctx = ZSTD_createCCtx();
+    compress.dctx = ZSTD_createDCtx();
+    if (!compress.cdict || !compress.ddict || !compress.cctx || !compress.dctx || !compress.dict_id) {
+        fprintf(stderr, "compression: dictionary %s not usable (trained dictionaries only, see --train)\n", cfg.compress_dictionary);
+        return -1;
+    }
+    printf("compression: zstd level %d, dictionary %s (id %u, %zu bytes)%s\n", cfg.compress_level, cfg.compress_dictionary, compress.dict_id, size,
+           cfg.compress_topic ? ", id in topic" : "");
+    return 0;
+#else
+    fprintf(stderr, "compression: not built with zstd support (make ZSTD=1), publishing uncompressed\n");
+    return 0;
+#endif
+}
+
+// returns the dictionary id the payload was compressed with (*out holds the frame), 0 if not compressed
+static unsigned compress_payload(const char *payload, size_t length, void **out, size_t *out_length) {
+#ifdef WITH_ZSTD
+    if (!compress.cdict)
+        return 0;
+    const size_t bound = ZSTD_compressBound(length);
+    void *frame = malloc(bound);
+    if (!frame)
+        return 0;
+    pthread_mutex_lock(&compress_mutex);
+    const size_t result = ZSTD_compress_usingCDict(compress.cctx, frame, bound, payload, length, compress.cdict);
+    if (!ZSTD_isError(result)) {
+        compress.bytes_in += length;
+        compress.bytes_out += result;
+    }
+    pthread_mutex_unlock(&compress_mutex);
+    if (ZSTD_isError(result)) {
+        debug("compression: failed (%s)", ZSTD_getErrorName(result));
+        free(frame);
+        return 0;
+    }
+    *out = frame;
+    *out_length = result;
+    return compress.dict_id;
+#else
+    (void)payload;
+    (void)length;
+    (void)out;
+    (void)out_length;
+    return 0;
+#endif
+}
+
+// our own retained payloads read back at startup; NULL if not a zstd frame for our dictionary
+static char *compress_inflate(const void *data, size_t length) {
+#ifdef WITH_ZSTD
+    if (!compress.ddict || length < 4 || ZSTD_getDictID_fromFrame(data, length) != compress.dict_id)
+        return NULL;
+    const unsigned long long size = ZSTD_getFrameContentSize(data, length);
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > 16 * 1024 * 1024)
+        return NULL;
+    char *payload = malloc((size_t)size + 1);
+    if (!payload)
+        return NULL;
+    pthread_mutex_lock(&compress_mutex);
+    const size_t result = ZSTD_decompress_usingDDict(compress.dctx, payload, (size_t)size, data, length, compress.ddict);
+    pthread_mutex_unlock(&compress_mutex);
+    if (ZSTD_isError(result)) {
+        free(payload);
+        return NULL;
+    }
+    payload[result] = '\0';
+    return payload;
+#else
+    (void)data;
+    (void)length;
+    return NULL;
+#endif
+}
+
+static int compress_active(void) {
+#ifdef WITH_ZSTD
+    return compress.cdict != NULL;
+#else
+    return 0;
+#endif
+}
+
+static void compress_topic_suffix(char *suffix, size_t sz) {
+    suffix[0] = '\0';
+#ifdef WITH_ZSTD
+    if (compress.cdict && cfg.compress_topic)
+        snprintf(suffix, sz, "/zstd-%u", compress.dict_id);
+#else
+    (void)sz;
+#endif
+}
+
+static void compress_close(void) {
+#ifdef WITH_ZSTD
+    if (compress.bytes_in)
+        debug("compression: %llu bytes to %llu (%.1fx)", compress.bytes_in, compress.bytes_out, (double)compress.bytes_in / (double)compress.bytes_out);
+    ZSTD_freeCDict(compress.cdict);
+    ZSTD_freeDDict(compress.ddict);
+    ZSTD_freeCCtx(compress.cctx);
+    ZSTD_freeDCtx(compress.dctx);
+    memset(&compress, 0, sizeof(compress));
+#endif
+}
+
+#ifdef WITH_ZSTD
+typedef struct {
+    char *samples;
+    size_t *sizes;
+    size_t used, capacity;
+    unsigned count, capacity_count;
+} train_samples_t;
+
+// archive segments only keep the raw reports, so each is wrapped back into the published payload shape for training
+static void train_sample_cb(time_t t, const char *icao, report_type_t type, const char *raw, size_t raw_len, void *userdata) {
+    train_samples_t *ts = (train_samples_t *)userdata;
+    char stamp[32], raw_str[MAX_TEMPLATE_TEXT];
+    timestamp_to_str(stamp, sizeof(stamp), t);
+    snprintf(raw_str, sizeof(raw_str), "%.*s", (int)raw_len, raw);
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "timestamp", stamp);
+    const station_t *st = station_find(icao);
+    cJSON *airport = cJSON_AddObjectToObject(root, "airport");
+    cJSON_AddStringToObject(airport, "icao", icao);
+    if (st) {
+        cJSON_AddStringToObject(airport, "name", st->name);
+        cJSON_AddNumberToObject(airport, "lat", st->lat);
+        cJSON_AddNumberToObject(airport, "lon", st->lon);
+        cJSON_AddNumberToObject(airport, "elev", st->elev_km * 1000);
+        cJSON_AddStringToObject(airport, "country", st->country);
+    }
+    cJSON *report = cJSON_AddObjectToObject(root, type == REPORT_METAR ? "metar" : "taf");
+    cJSON_AddStringToObject(report, type == REPORT_METAR ? "observed" : "issued", stamp);
+    cJSON_AddStringToObject(report, "raw", raw_str);
+    char *payload = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    const size_t length = strlen(payload);
+    if (ts->used + length > ts->capacity) {
+        ts->capacity = (ts->used + length) * 2;
+        ts->samples = realloc(ts->samples, ts->capacity);
+    }
+    if (ts->count == ts->capacity_count) {
+        ts->capacity_count = ts->capacity_count ? ts->capacity_count * 2 : 1024;
+        ts->sizes = realloc(ts->sizes, sizeof(size_t) * ts->capacity_count);
+    }
+    if (ts->samples && ts->sizes) {
+        memcpy(ts->samples + ts->used, payload, length);
+        ts->sizes[ts->count++] = length;
+        ts->used += length;
+    }
+    free(payload);
+}
+#endif
+
+static int compress_train(const char *path, char **segments, int segment_count) {
+#ifdef WITH_ZSTD
+    train_samples_t ts = {NULL, NULL, 0, 0, 0, 0};
+    archive_dict_t *dict = malloc(sizeof(archive_dict_t));
+    if (!dict)
+        return -1;
+    for (int i = 0; i < segment_count; i++)
+        if (archive_scan(segments[i], dict, train_sample_cb, &ts) < 0)
+            fprintf(stderr, "train: %s: not a readable archive segment\n", segments[i]);
+    free(dict);
+    int rc = -1;
+    uint8_t *dictionary = malloc(COMPRESS_DICT_SIZE);
+    if (ts.count < COMPRESS_TRAIN_MIN)
+        fprintf(stderr, "train: %u sample(s), need at least %d\n", ts.count, COMPRESS_TRAIN_MIN);
+    else if (dictionary) {
+        const size_t size = ZDICT_trainFromBuffer(dictionary, COMPRESS_DICT_SIZE, ts.samples, ts.sizes, ts.count);
+        FILE *f = ZDICT_isError(size) ? NULL : fopen(path, "wb");
+        if (ZDICT_isError(size))
+            fprintf(stderr, "train: failed (%s)\n", ZDICT_getErrorName(size));
+        else if (!f)
+            fprintf(stderr, "train: cannot write %s: %s\n", path, strerror(errno));
+        else {
+            rc = fwrite(dictionary, 1, size, f) == size ? 0 : -1;
+            fclose(f);
+            printf("train: %u sample(s) (%zu bytes), dictionary %s (id %u, %zu bytes)\n", ts.count, ts.used, path, ZDICT_getDictID(dictionary, size), size);
+        }
+    }
+    free(dictionary);
+    free(ts.samples);
+    free(ts.sizes);
+    return rc;
+#else
+    (void)path;
+    (void)segments;
+    (void)segment_count;
+    fprintf(stderr, "train: not built with zstd support (make ZSTD=1)\n");
+    return -1;
+#endif
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+static void publish_properties(mosquitto_property **props, const publish_meta_t *meta, unsigned dict_id) {
+    char stamp[32];
+    if (dict_id) {
+        mosquitto_property_add_string(props, MQTT_PROP_CONTENT_TYPE, "application/zstd");
+        if (!cfg.compress_topic) {
+            char id[16];
+            snprintf(id, sizeof(id), "%u", dict_id);
+            mosquitto_property_add_string_pair(props, MQTT_PROP_USER_PROPERTY, "zstd-dictionary", id);
+        }
+    } else {
+        mosquitto_property_add_byte(props, MQTT_PROP_PAYLOAD_FORMAT_INDICATOR, 1);
+        mosquitto_property_add_string(props, MQTT_PROP_CONTENT_TYPE, "application/json");
+    }
+    if (meta && meta->expires > 0) {
+        time_t expiry = meta->expires - time(NULL);
+        if (expiry < 60)
+            expiry = 60;
+        mosquitto_property_add_int32(props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, (uint32_t)expiry);
+    }
+    if (meta && meta->observed > 0)
+        mosquitto_property_add_string_pair(props, MQTT_PROP_USER_PROPERTY, "observed", timestamp_to_str(stamp, sizeof(stamp), meta->observed));
+    if (meta && meta->issued > 0)
+        mosquitto_property_add_string_pair(props, MQTT_PROP_USER_PROPERTY, "issued", timestamp_to_str(stamp, sizeof(stamp), meta->issued));
+}
+
+static int broker_address(const char *url, char *host, size_t sz) {
+    int port = 1883;
+    const char *h = strncmp(url, "mqtt://", 7) == 0 ? url + 7 : url;
+    const size_t length = strlen(h) < sz ? strlen(h) : sz - 1;
+    memcpy(host, h, length);
+    host[length] = '\0';
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = 0;
+        port = atoi(colon + 1);
+    }
+    return port;
+}
+
+static void broker_message_free(broker_message_t *message) {
+    free(message->payload);
+    free(message);
+}
+
+// queues a report for one fan-out broker: a queued message for the same topic and retain flag is replaced (only the latest
+// value matters), otherwise the oldest is dropped once the queue is full
+static void broker_enqueue(broker_t *b, const char *topic, const void *payload, size_t length, const publish_meta_t *meta, unsigned dict_id, int retain) {
+    broker_message_t *message = calloc(1, sizeof(broker_message_t));
+    if (!message || !(message->payload = malloc(length ? length : 1))) {
+        free(message);
+        return;
+    }
+    snprintf(message->topic, sizeof(message->topic), "%s", topic);
+    memcpy(message->payload, payload, length);
+    message->length = length;
+    if (meta)
+        message->meta = *meta;
+    message->dict_id = dict_id;
+    message->retain = retain;
+    pthread_mutex_lock(&b->mutex);
+    for (broker_message_t *m = b->head; m; m = m->next)
+        if (m->retain == retain && strcmp(m->topic, topic) == 0) {
+            void *previous = m->payload;
+            m->payload = message->payload;
+            m->length = message->length;
+            m->meta = message->meta;
+            m->dict_id = message->dict_id;
+            message->payload = previous;
+            b->coalesced++;
+            pthread_mutex_unlock(&b->mutex);
+            broker_message_free(message);
+            return;
+        }
+    broker_message_t *dropped = NULL;
+    if (b->queued >= b->config.queue) {
+        dropped = b->head;
+        b->head = dropped->next;
+        if (!b->head)
+            b->tail = NULL;
+        b->queued--;
+        b->dropped++;
+    }
+    if (b->tail)
+        b->tail->next = message;
+    else
+        b->head = message;
+    b->tail = message;
+    b->queued++;
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->mutex);
+    if (dropped) {
+        debug("broker: %s queue full, dropped %s", b->config.broker, dropped->topic);
+        broker_message_free(dropped);
+    }
+}
+
+// caller holds b->mutex
+static broker_message_t *broker_dequeue(broker_t *b) {
+    broker_message_t *message = b->head;
+    if (message) {
+        b->head = message->next;
+        if (!b->head)
+            b->tail = NULL;
+        b->queued--;
+    }
+    return message;
+}
+
+// puts a message that could not be sent back at the head, unless a newer value for its topic is queued meanwhile;
+// caller holds b->mutex
+static void broker_requeue(broker_t *b, broker_message_t *message) {
+    for (broker_message_t *m = b->head; m; m = m->next)
+        if (m->retain == message->retain && strcmp(m->topic, message->topic) == 0) {
+            b->coalesced++;
+            broker_message_free(message);
+            return;
+        }
+    if (b->queued >= b->config.queue) {
+        b->dropped++;
+        broker_message_free(message);
+        return;
+    }
+    message->next = b->head;
+    b->head = message;
+    if (!b->tail)
+        b->tail = message;
+    b->queued++;
+}
+
+// QoS 1, so the broker's PUBACK (broker_publish_cb) is what frees a slot in the in-flight window
+static int broker_send(broker_t *b, const broker_message_t *message) {
+    int rc;
+    if (b->config.protocol_version == MQTT_PROTOCOL_V5) {
+        mosquitto_property *props = NULL;
+        publish_properties(&props, &message->meta, message->dict_id);
+        rc = mosquitto_publish_v5(b->mosq, NULL, message->topic, (int)message->length, message->payload, 1, message->retain, props);
+        mosquitto_property_free_all(&props);
+    } else
+        rc = mosquitto_publish(b->mosq, NULL, message->topic, (int)message->length, message->payload, 1, message->retain);
+    if (rc != MOSQ_ERR_SUCCESS)
+        debug("broker: %s publish failed (%s)", b->config.broker, mosquitto_strerror(rc));
+    return rc;
+}
+
+static void broker_connect_cb(struct mosquitto *m, void *userdata, int rc) {
+    (void)m;
+    broker_t *b = (broker_t *)userdata;
+    if (rc != 0) {
+        debug("broker: %s connect refused (%s)", b->config.broker, mosquitto_strerror(rc));
+        return;
+    }
+    debug("broker: %s connected", b->config.broker);
+    pthread_mutex_lock(&b->mutex);
+    b->connected = 1;
+    b->inflight = 0; // unacknowledged messages are resent by mosquitto itself
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+static void broker_disconnect_cb(struct mosquitto *m, void *userdata, int rc) {
+    (void)m;
+    broker_t *b = (broker_t *)userdata;
+    debug("broker: %s disconnected (%s), queueing", b->config.broker, mosquitto_strerror(rc));
+    pthread_mutex_lock(&b->mutex);
+    b->connected = 0;
+    pthread_mutex_unlock(&b->mutex);
+}
+
+static void broker_publish_cb(struct mosquitto *m, void *userdata, int mid) {
+    (void)m;
+    (void)mid;
+    broker_t *b = (broker_t *)userdata;
+    pthread_mutex_lock(&b->mutex);
+    if (b->inflight > 0)
+        b->inflight--;
+    b->published++;
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+// caller holds b->mutex
+static void broker_wait(broker_t *b) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&b->cond, &b->mutex, &deadline);
+}
+
+// drains one fan-out broker's queue while it is connected, at most BROKER_INFLIGHT unacknowledged messages at a time; its
+// network loop and reconnects run in mosquitto's own thread, so a slow or unreachable broker only ever holds up its own queue.
+// On shutdown the queue and window get BROKER_DRAIN_SECONDS to empty.
+static void *broker_thread(void *arg) {
+    broker_t *b = (broker_t *)arg;
+    time_t stopping = 0;
+    pthread_mutex_lock(&b->mutex);
+    while (!b->stop || (b->connected && (b->head || b->inflight))) {
+        if (b->stop && !stopping)
+            stopping = time(NULL);
+        if (stopping && time(NULL) - stopping >= BROKER_DRAIN_SECONDS)
+            break;
+        if (!b->connected || !b->head || b->inflight >= BROKER_INFLIGHT) {
+            broker_wait(b);
+            continue;
+        }
+        broker_message_t *message = broker_dequeue(b);
+        b->inflight++;
+        pthread_mutex_unlock(&b->mutex);
+        const int rc = broker_send(b, message);
+        pthread_mutex_lock(&b->mutex);
+        if (rc != MOSQ_ERR_SUCCESS) {
+            b->inflight--;
+            if (rc == MOSQ_ERR_NO_CONN) {
+                // lost the connection before the disconnect callback ran: keep the message and retry after a pause
+                broker_requeue(b, message);
+                broker_wait(b);
+                continue;
+            }
+        }
+        broker_message_free(message);
+    }
+    pthread_mutex_unlock(&b->mutex);
+    return NULL;
+}
+
+static void brokers_start(void) {
+    for (int i = 0; i < cfg.broker_count; i++) {
+        broker_t *b = &brokers[broker_count];
+        memset(b, 0, sizeof(*b));
+        b->config = cfg.brokers[i];
+        if (b->config.queue <= 0)
+            b->config.queue = BROKER_QUEUE;
+        if (b->config.compress && !compress_active())
+            fprintf(stderr, "broker: %s wants zstd but no dictionary is loaded, publishing json\n", b->config.broker);
+        b->mosq = mosquitto_new(b->config.client_id, true, b);
+        if (!b->mosq) {
+            fprintf(stderr, "broker: %s: mosquitto_new failed\n", b->config.broker);
+            continue;
+        }
+        if (b->config.username[0])
+            mosquitto_username_pw_set(b->mosq, b->config.username, b->config.password);
+        if (b->config.protocol_version == MQTT_PROTOCOL_V5)
+            mosquitto_int_option(b->mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+        mosquitto_connect_callback_set(b->mosq, broker_connect_cb);
+        mosquitto_disconnect_callback_set(b->mosq, broker_disconnect_cb);
+        mosquitto_publish_callback_set(b->mosq, broker_publish_cb);
+        mosquitto_reconnect_delay_set(b->mosq, 1, BROKER_RECONNECT_MAX_SECONDS, true);
+        pthread_mutex_init(&b->mutex, NULL);
+        pthread_cond_init(&b->cond, NULL);
+        char host[256];
+        const int port = broker_address(b->config.broker, host, sizeof(host));
+        const int rc = mosquitto_connect_async(b->mosq, host, port, 60);
+        if (rc != MOSQ_ERR_SUCCESS)
+            debug("broker: %s:%d connect failed (%s), retrying in background", host, port, mosquitto_strerror(rc));
+        if (mosquitto_loop_start(b->mosq) != MOSQ_ERR_SUCCESS || pthread_create(&b->thread, NULL, broker_thread, b) != 0) {
+            fprintf(stderr, "broker: %s: thread create failed\n", b->config.broker);
+            mosquitto_loop_stop(b->mosq, true);
+            mosquitto_destroy(b->mosq);
+            pthread_cond_destroy(&b->cond);
+            pthread_mutex_destroy(&b->mutex);
+            continue;
+        }
+        printf("broker: fan-out to %s:%d as '%s' (prefix %s, %s, queue %d)\n", host, port, b->config.client_id, b->config.topic_prefix,
+               b->config.compress && compress_active() ? "zstd" : "json", b->config.queue);
+        broker_count++;
+    }
+}
+
+// hands one report to every fan-out broker; 'path' is the topic below the prefix
+static void brokers_publish(const char *path, const char *payload, size_t length, const void *compressed, size_t compressed_length, unsigned dict_id,
+                            const publish_meta_t *meta, int retain) {
+    for (int i = 0; i < broker_count; i++) {
+        broker_t *b = &brokers[i];
+        const int zstd = b->config.compress && dict_id;
+        char topic[MAX_TOPIC], topic_suffix[32] = "";
+        if (zstd)
+            compress_topic_suffix(topic_suffix, sizeof(topic_suffix));
+        snprintf(topic, sizeof(topic), "%s/%s%s", b->config.topic_prefix, path, topic_suffix);
+        if (zstd)
+            broker_enqueue(b, topic, compressed, compressed_length, meta, dict_id, retain);
+        else
+            broker_enqueue(b, topic, payload, length, meta, 0, retain);
+    }
+}
+
+static void brokers_stop(void) {
+    for (int i = 0; i < broker_count; i++) {
+        broker_t *b = &brokers[i];
+        pthread_mutex_lock(&b->mutex);
+        b->stop = 1;
+        pthread_cond_signal(&b->cond);
+        pthread_mutex_unlock(&b->mutex);
+    }
+    for (int i = 0; i < broker_count; i++) {
+        broker_t *b = &brokers[i];
+        pthread_join(b->thread, NULL);
+        debug("broker: %s: %lu published, %lu coalesced, %lu dropped, %d unsent, %d unacknowledged", b->config.broker, b->published, b->coalesced,
+              b->dropped, b->queued, b->inflight);
+        broker_message_t *message;
+        while ((message = broker_dequeue(b)))
+            broker_message_free(message);
+        mosquitto_disconnect(b->mosq);
+        mosquitto_loop_stop(b->mosq, true);
+        mosquitto_destroy(b->mosq);
+        pthread_cond_destroy(&b->cond);
+        pthread_mutex_destroy(&b->mutex);
+    }
+    broker_count = 0;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// an alias is only registered by topic_alias_commit() once the publish that introduces it went out
+static int topic_alias_get(const char *topic, int *established) {
+    if (atomic_exchange(&topic_alias_reset, 0))
+        topic_alias_count = 0;
+    for (int i = 0; i < topic_alias_count; i++)
+        if (strcmp(topic_aliases[i], topic) == 0) {
+            *established = 1;
+            return i + 1;
+        }
+    if (topic_alias_count >= atomic_load(&topic_alias_maximum) || topic_alias_count >= MAX_TOPIC_ALIASES)
+        return 0;
+    *established = 0;
+    return topic_alias_count + 1;
+}
+
+static void topic_alias_commit(const char *topic, int alias) {
+    if (alias != topic_alias_count + 1)
+        return;
+    snprintf(topic_aliases[topic_alias_count], MAX_TOPIC, "%s", topic);
+    topic_alias_count++;
+}
+
+static void publish_payload_v5(const char *topic, const void *payload, size_t length, const publish_meta_t *meta, unsigned dict_id, int retain) {
+    mosquitto_property *props = NULL;
+    int established = 0;
+    const int alias = topic_alias_get(topic, &established);
+    if (alias > 0)
+        mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, (uint16_t)alias);
+    publish_properties(&props, meta, dict_id);
+    const int rc = mosquitto_publish_v5(mosq, NULL, established ? "" : topic, (int)length, payload, 0, retain, props);
+    if (rc != MOSQ_ERR_SUCCESS)
+        debug("publish: failed (%s)", mosquitto_strerror(rc));
+    else if (alias > 0 && !established)
+        topic_alias_commit(topic, alias);
+    mosquitto_property_free_all(&props);
+}
+
+static int brokers_compress(void) {
+    for (int i = 0; i < broker_count; i++)
+        if (brokers[i].config.compress)
+            return 1;
+    return 0;
+}
+
+// 'path' is the topic below the prefix; compressed once for every destination whose format is zstd, unless not 'compressible'
+static void publish_path(const char *path, const cJSON *root, const publish_meta_t *meta, int retain, int compressible) {
+    char *payload = cJSON_PrintUnformatted(root);
+    void *compressed = NULL;
+    const size_t length = strlen(payload);
+    size_t compressed_length = 0;
+    const unsigned dict_id = compressible && (cfg.compress || brokers_compress()) ? compress_payload(payload, length, &compressed, &compressed_length) : 0;
+    const unsigned primary_dict_id = cfg.compress ? dict_id : 0;
+    char topic[MAX_TOPIC], topic_suffix[32];
+    compress_topic_suffix(topic_suffix, sizeof(topic_suffix));
+    snprintf(topic, sizeof(topic), "%s/%s%s", cfg.topic_prefix, path, primary_dict_id ? topic_suffix : "");
+    debug("publish: %zu bytes to %s\n", primary_dict_id ? compressed_length : length, topic);
+    const void *data = primary_dict_id ? compressed : (const void *)payload;
+    const size_t data_length = primary_dict_id ? compressed_length : length;
+    if (cfg.protocol_version == MQTT_PROTOCOL_V5)
+        publish_payload_v5(topic, data, data_length, meta, primary_dict_id, retain);
+    else
+        mosquitto_publish(mosq, NULL, topic, (int)data_length, data, 0, retain);
+    brokers_publish(path, payload, length, compressed, compressed_length, dict_id, meta, retain);
+    free(compressed);
+    free(payload);
+}
+
+static void publish_payload(const airport_t *ap, const cJSON *root, const char *suffix, const publish_meta_t *meta, int retain) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s%s%s", ap->icao, suffix ? "/" : "", suffix ? suffix : "");
+    publish_path(path, root, meta, retain, 1);
+}
+static void publish_type(airport_t *ap, const char *timestamp, const cJSON *object, const char *name, const publish_meta_t *meta) {
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "timestamp", timestamp);
+    cJSON_AddItemToObject(root, "airport", cJSON_Duplicate(ap->json, 1));
+    cJSON_AddItemToObject(root, name, cJSON_Duplicate(object, 1));
+    publish_payload(ap, root, name, meta, 1);
+    cJSON_Delete(root);
+}
+static void publish_split(airport_t *ap, const char *timestamp, const cJSON *metar, int metar_changed, const publish_meta_t *metar_meta, const cJSON *taf, int taf_changed,
+                          const publish_meta_t *taf_meta) {
+    if (metar && metar_changed)
+        publish_type(ap, timestamp, metar, "metar", metar_meta);
+    if (taf && taf_changed)
+        publish_type(ap, timestamp, taf, "taf", taf_meta);
+}
+
+static void publish_combined(airport_t *ap, const char *timestamp, const cJSON *metar, const publish_meta_t *metar_meta, const cJSON *taf, const publish_meta_t *taf_meta) {
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "timestamp", timestamp);
+    cJSON_AddItemToObject(root, "airport", cJSON_Duplicate(ap->json, 1));
+    publish_meta_t meta = {0, 0, 0};
+    if (metar) {
+        cJSON_AddItemToObject(root, "metar", cJSON_Duplicate(metar, 1));
+        meta.observed = metar_meta->observed;
+        meta.expires = metar_meta->expires;
+    }
+    if (taf) {
+        cJSON_AddItemToObject(root, "taf", cJSON_Duplicate(taf, 1));
+        meta.issued = taf_meta->issued;
+        if (taf_meta->expires > meta.expires)
+            meta.expires = taf_meta->expires;
+    }
+    publish_payload(ap, root, NULL, &meta, 1);
+    cJSON_Delete(root);
+}
+
+static void delta_pointer(char *out, size_t sz, const char *path, const char *key) {
+    size_t n = (size_t)snprintf(out, sz, "%s/", path);
+    for (const char *p = key; *p && n + 2 < sz; p++) {
+        if (*p == '~' || *p == '/') {
+            out[n++] = '~';
+            out[n++] = *p == '~' ? '0' : '1';
+        } else
+            out[n++] = *p;
+    }
+    out[n < sz ? n : sz - 1] = '\0';
+}
+
+static void delta_op(cJSON *ops, const char *op, const char *path, const cJSON *value) {
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "op", op);
+    cJSON_AddStringToObject(item, "path", path);
+    if (value)
+        cJSON_AddItemToObject(item, "value", cJSON_Duplicate(value, 1));
+    cJSON_AddItemToArray(ops, item);
+}
+
+// appends the JSON Patch (RFC 6902) operations turning 'from' into 'to'; arrays (TAF timeline periods) are patched per element
+static void delta_diff(cJSON *ops, const char *path, const cJSON *from, const cJSON *to) {
+    if (cJSON_Compare(from, to, 1))
+        return;
+    char child[MAX_TOPIC];
+    if (cJSON_IsObject(from) && cJSON_IsObject(to)) {
+        const cJSON *item;
+        cJSON_ArrayForEach(item, from) {
+            if (!cJSON_GetObjectItemCaseSensitive(to, item->string)) {
+                delta_pointer(child, sizeof(child), path, item->string);
+                delta_op(ops, "remove", child, NULL);
+            }
+        }
+        cJSON_ArrayForEach(item, to) {
+            const cJSON *previous = cJSON_GetObjectItemCaseSensitive(from, item->string);
+            delta_pointer(child, sizeof(child), path, item->string);
+            if (previous)
+                delta_diff(ops, child, previous, item);
+            else
+                delta_op(ops, "add", child, item);
+        }
+    } else if (cJSON_IsArray(from) && cJSON_IsArray(to)) {
+        const int from_count = cJSON_GetArraySize(from), to_count = cJSON_GetArraySize(to);
+        for (int i = 0; i < from_count && i < to_count; i++) {
+            snprintf(child, sizeof(child), "%s/%d", path, i);
+            delta_diff(ops, child, cJSON_GetArrayItem(from, i), cJSON_GetArrayItem(to, i));
+        }
+        for (int i = from_count - 1; i >= to_count; i--) {
+            snprintf(child, sizeof(child), "%s/%d", path, i);
+            delta_op(ops, "remove", child, NULL);
+        }
+        snprintf(child, sizeof(child), "%s/-", path);
+        for (int i = from_count; i < to_count; i++)
+            delta_op(ops, "add", child, cJSON_GetArrayItem(to, i));
+    } else
+        delta_op(ops, "replace", path, to);
+}
+
+// publishes the report on 'prefix/ICAO/type/delta': a retained keyframe (airport and full report) every cfg.delta_keyframe
+// publications, and in between non-retained patches against that keyframe, so any one patch plus the keyframe gives the report
+static void publish_delta(airport_t *ap, const char *timestamp, report_type_t type, const cJSON *report, const publish_meta_t *meta) {
+    delta_t *d = &ap->delta[type];
+    const char *name = type == REPORT_METAR ? "metar" : "taf";
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "%s/delta", name);
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "timestamp", timestamp);
+    cJSON_AddNumberToObject(root, "seq", ++d->seq);
+    const int keyframe = !d->base || d->seq - d->keyframe >= cfg.delta_keyframe;
+    if (keyframe) {
+        if (d->base)
+            cJSON_Delete(d->base);
+        d->base = cJSON_Duplicate(report, 1);
+        d->keyframe = d->seq;
+        cJSON_AddTrueToObject(root, "keyframe");
+        cJSON_AddItemToObject(root, "airport", cJSON_Duplicate(ap->json, 1));
+        cJSON_AddItemToObject(root, name, cJSON_Duplicate(report, 1));
+        debug("[%s] %s delta %d: keyframe", ap->icao, name, d->seq);
+    } else {
+        cJSON *ops = cJSON_CreateArray();
+        delta_diff(ops, "", d->base, report);
+        cJSON_AddNumberToObject(root, "base", d->keyframe);
+        debug("[%s] %s delta %d: %d operation(s) against keyframe %d", ap->icao, name, d->seq, cJSON_GetArraySize(ops), d->keyframe);
+        cJSON_AddItemToObject(root, "patch", ops);
+    }
+    publish_payload(ap, root, suffix, meta, keyframe);
+    cJSON_Delete(root);
+}
+
+static void delta_free(airport_t *ap) {
+    for (int i = 0; i < 2; i++)
+        if (ap->delta[i].base)
+            cJSON_Delete(ap->delta[i].base);
+    memset(ap->delta, 0, sizeof(ap->delta));
+}
+
+// keeps the compact form of the latest report of the type for the snapshot, marking the snapshot changed only if it differs
+static void snapshot_update(airport_t *ap, report_type_t type, const cJSON *report) {
+    static const char *const fields[] = {"observed", "issued", "raw", "text", "speci", "off_cycle"};
+    cJSON *entry = cJSON_CreateObject();
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        const cJSON *v = cJSON_GetObjectItem(report, fields[i]);
+        if (v && (type == REPORT_METAR || strcmp(fields[i], "text") != 0)) // the TAF text is too long to be compact
+            cJSON_AddItemToObject(entry, fields[i], cJSON_Duplicate(v, 1));
+    }
+    if (ap->latest[type] && cJSON_Compare(ap->latest[type], entry, 1)) {
+        cJSON_Delete(entry);
+        return;
+    }
+    if (ap->latest[type])
+        cJSON_Delete(ap->latest[type]);
+    ap->latest[type] = entry;
+    if (!snapshot_changed)
+        snapshot_changed = time(NULL);
+}
+
+static void snapshot_free(airport_t *ap) {
+    for (int i = 0; i < 2; i++)
+        if (ap->latest[i])
+            cJSON_Delete(ap->latest[i]);
+    memset(ap->latest, 0, sizeof(ap->latest));
+}
+
+// every airport's latest reports coalesced into one retained message on 'prefix/_snapshot' (per node when clustered), published
+// after the cycle once the first unpublished change is cfg.snapshot_debounce seconds old
+static void snapshot_tick(time_t now) {
+    if (!cfg.snapshot_enabled || !snapshot_changed || now - snapshot_changed < cfg.snapshot_debounce)
+        return;
+    char stamp[32];
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "timestamp", timestamp_to_str(stamp, sizeof(stamp), now));
+    cJSON *airports = cJSON_AddObjectToObject(root, "airports");
+    int count = 0;
+    for (int i = 0; i < cfg.airport_count; i++) {
+        const airport_t *ap = &cfg.airports[i];
+        if (!ap->owned || (!ap->latest[REPORT_METAR] && !ap->latest[REPORT_TAF]))
+            continue;
+        cJSON *entry = cJSON_AddObjectToObject(airports, ap->icao);
+        static const char *const fields[] = {"name", "lat", "lon"};
+        for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+            const cJSON *v = cJSON_GetObjectItem(ap->json, fields[f]);
+            if (v)
+                cJSON_AddItemToObject(entry, fields[f], cJSON_Duplicate(v, 1));
+        }
+        if (ap->latest[REPORT_METAR])
+            cJSON_AddItemToObject(entry, "metar", cJSON_Duplicate(ap->latest[REPORT_METAR], 1));
+        if (ap->latest[REPORT_TAF])
+            cJSON_AddItemToObject(entry, "taf", cJSON_Duplicate(ap->latest[REPORT_TAF], 1));
+        count++;
+    }
+    cJSON_AddNumberToObject(root, "count", count);
+    char path[96] = "_snapshot";
+    if (cfg.cluster_enabled)
+        snprintf(path, sizeof(path), "_snapshot/%s", cfg.cluster_node);
+    publish_path(path, root, NULL, 1, cfg.snapshot_compress);
+    cJSON_Delete(root);
+    debug("snapshot: %d airport(s), %ld second(s) after the first change", count, (long)(now - snapshot_changed));
+    snapshot_changed = 0;
+}
+
+// the TAF period in force and the next one, republished whenever the period changes
+static void publish_effective(airport_t *ap, time_t now) {
+    if (!ap->taf_timeline || !ap->taf_changes || now < ap->taf_changes)
+        return;
+    time_t changes = 0;
+    char stamp[32];
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "timestamp", timestamp_to_str(stamp, sizeof(stamp), now));
+    cJSON_AddItemToObject(root, "airport", cJSON_Duplicate(ap->json, 1));
+    cJSON_AddStringToObject(root, "issued", timestamp_to_str(stamp, sizeof(stamp), ap->sched_taf.last_issued));
+    cJSON_AddItemToObject(root, "effective", taf_effective(ap->taf_timeline, now, &changes));
+    const publish_meta_t meta = {0, ap->sched_taf.last_issued, changes};
+    publish_payload(ap, root, "taf/effective", &meta, 1);
+    cJSON_Delete(root);
+    debug("[%s] TAF effective published, next change %s", ap->icao, changes ? timestamp_to_str(stamp, sizeof(stamp), changes) : "none");
+    ap->taf_changes = changes;
+}
+
+static time_t metar_expires(const schedule_t *sched, time_t observed) {
+    if (observed == 0)
+        return 0;
+    const int period = sched->learned_period > 0 && sched->learned_period < METAR_CAP_MINUTES * 60 ? sched->learned_period : METAR_CAP_MINUTES * 60;
+    return observed + 2 * period + SLACK_SECONDS;
+}
+
+static void fetch_and_publish(airport_t *ap) {
+    const int64_t trace_start = trace_now();
+    char timestamp[32];
+    const time_t now = time(NULL);
+    timestamp_to_str(timestamp, sizeof(timestamp), now);
+
+    cJSON *metar = NULL, *taf = NULL;
+    int metar_changed = 0, taf_changed = 0, fetched = 0;
+    time_t observed = 0, issued = 0, valid_to = 0;
+
+    if (ap->fetch_metar && schedule_due(&ap->sched_metar, now) && ratelimit_take(&ratelimit, ap->priority)) {
+        char url[MAX_URL];
+        snprintf(url, sizeof(url), "/metar?format=xml&taf=false&ids=%s", ap->icao);
+        char *xml = fetch_upstream(url, ap->icao, ap->priority);
+        fetched = 1;
+        if (xml) {
+            const int64_t start = trace_now();
+            metar = process_metar(xml, ap, &observed);
+            trace_end("parse metar", ap->icao, start);
+            free(xml);
+        }
+        if (!metar)
+            schedule_failed(&ap->sched_metar, ap->icao, "METAR", time(NULL));
+        else {
+            schedule_succeeded(&ap->sched_metar, ap->icao, "METAR");
+            metar_changed = schedule_observe(&ap->sched_metar, ap->icao, "METAR", observed, time(NULL), ap->interval, METAR_CAP_MINUTES, ap->priority,
+                                             cJSON_IsTrue(cJSON_GetObjectItem(metar, "speci")));
+            if (metar_changed == OBSERVE_SPECIAL)
+                cJSON_AddBoolToObject(metar, "off_cycle", 1);
+        }
+    }
+
+    if (ap->fetch_taf && schedule_due(&ap->sched_taf, now) && ratelimit_take(&ratelimit, ap->priority)) {
+        char url[MAX_URL];
+        snprintf(url, sizeof(url), "/taf?format=xml&ids=%s", ap->icao);
+        char *xml = fetch_upstream(url, ap->icao, ap->priority);
+        fetched = 1;
+        if (xml) {
+            const int64_t start = trace_now();
+            taf = process_taf(xml, ap, &issued, &valid_to);
+            trace_end("parse taf", ap->icao, start);
+            free(xml);
+        }
+        if (!taf)
+            schedule_failed(&ap->sched_taf, ap->icao, "TAF", time(NULL));
+        else {
+            schedule_succeeded(&ap->sched_taf, ap->icao, "TAF");
+            taf_changed = schedule_observe(&ap->sched_taf, ap->icao, "TAF", issued, time(NULL), ap->interval, TAF_CAP_MINUTES, ap->priority, 0);
+        }
+    }
+
+    const publish_meta_t metar_meta = {observed, 0, metar_expires(&ap->sched_metar, observed)};
+    const publish_meta_t taf_meta = {0, issued, valid_to};
+    // a seeded schedule only suppresses republishing: the first fetch still fills history and the shm feed
+    const int metar_local = metar && (metar_changed || ap->sched_metar.seeded);
+    const int taf_local = taf && (taf_changed || ap->sched_taf.seeded);
+    if (metar)
+        ap->sched_metar.seeded = 0;
+    if (taf)
+        ap->sched_taf.seeded = 0;
+    int64_t stage_start = trace_now();
+    if (metar_local)
+        history_add(ap, REPORT_METAR, observed, metar);
+    if (taf_local)
+        history_add(ap, REPORT_TAF, issued, taf);
+    // also when there is none yet: after retained recovery or a handover the first TAF is "unchanged"
+    const cJSON *timeline = taf && (taf_changed || !ap->taf_timeline) ? cJSON_GetObjectItem(taf, "timeline") : NULL;
+    if (timeline) {
+        if (ap->taf_timeline)
+            cJSON_Delete(ap->taf_timeline);
+        ap->taf_timeline = cJSON_Duplicate(timeline, 1);
+        ap->taf_changes = now;
+    }
+    if (metar_local)
+        shm_feed_write(ap, REPORT_METAR, observed, metar);
+    if (taf_local)
+        shm_feed_write(ap, REPORT_TAF, issued, taf);
+    if (metar && metar_changed && observed != ap->sched_metar.last_archived) {
+        archive_add(ap, REPORT_METAR, observed, metar);
+        ap->sched_metar.last_archived = observed;
+    }
+    if (taf && taf_changed && issued != ap->sched_taf.last_archived) {
+        archive_add(ap, REPORT_TAF, issued, taf);
+        ap->sched_taf.last_archived = issued;
+    }
+    // from every parsed report, so a recovered or handed over airport is in the snapshot before its next new report
+    if (cfg.snapshot_enabled) {
+        if (metar)
+            snapshot_update(ap, REPORT_METAR, metar);
+        if (taf)
+            snapshot_update(ap, REPORT_TAF, taf);
+    }
+    trace_end("record", ap->icao, stage_start);
+
+    stage_start = trace_now();
+    if (opts.split) {
+        publish_split(ap, timestamp, metar, metar_changed, &metar_meta, taf, taf_changed, &taf_meta);
+    } else {
+        if (metar_changed || taf_changed)
+            publish_combined(ap, timestamp, metar, &metar_meta, taf, &taf_meta);
+        else
+            debug("[%s] nothing to publish", ap->icao);
+    }
+    if (cfg.delta_keyframe > 0) {
+        if (metar && metar_changed)
+            publish_delta(ap, timestamp, REPORT_METAR, metar, &metar_meta);
+        if (taf && taf_changed)
+            publish_delta(ap, timestamp, REPORT_TAF, taf, &taf_meta);
+    }
+    trace_end("publish", ap->icao, stage_start);
+
+    if (metar)
+        cJSON_Delete(metar);
+    if (taf)
+        cJSON_Delete(taf);
+    if (fetched)
+        ap->last_fetch = now;
+    trace_end("fetch_and_publish", ap->icao, trace_start);
+}
+
+static int should_fetch(const airport_t *ap) {
+    const time_t now = time(NULL);
+    if (opts.all && now - ap->last_fetch < ap->interval * 60)
+        return 0;
+    if (ap->fetch_metar && schedule_due(&ap->sched_metar, now))
+        return 1;
+    if (ap->fetch_taf && schedule_due(&ap->sched_taf, now))
+        return 1;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// replays issuance traces through the scheduling code on a virtual clock: only the fetch decisions are simulated,
+// upstream answers come from the trace (latest report already served, or a failure during an outage)
+
+static sim_report_t *sim_trace_add(sim_trace_t *trace, time_t observed, int delay) {
+    if (trace->count == trace->capacity) {
+        const int capacity = trace->capacity ? trace->capacity * 2 : 256;
+        sim_report_t *reports = realloc(trace->reports, sizeof(sim_report_t) * (size_t)capacity);
+        if (!reports)
+            return NULL;
+        trace->reports = reports;
+        trace->capacity = capacity;
+    }
+    sim_report_t *report = &trace->reports[trace->count++];
+    report->observed = observed;
+    report->available = observed + delay;
+    report->special = 0;
+    return report;
+}
+
+static int sim_report_compare(const void *a, const void *b) {
+    const time_t ta = ((const sim_report_t *)a)->observed, tb = ((const sim_report_t *)b)->observed;
+    return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+static int sim_random(int min, int max) {
+    return min + rand() % (max - min + 1);
+}
+
+// routine METAR at :20, served 1-4 minutes later
+static void sim_generate_hourly(sim_trace_t *trace, time_t start, time_t end) {
+    for (time_t t = start + 20 * 60; t < end; t += 60 * 60)
+        sim_trace_add(trace, t, sim_random(60, 240));
+}
+
+static void sim_generate_half_hourly(sim_trace_t *trace, time_t start, time_t end) {
+    for (time_t t = start + 20 * 60; t < end; t += 30 * 60)
+        sim_trace_add(trace, t, sim_random(60, 240));
+}
+
+// hourly, plus one in eight hours with a burst of 1-3 SPECIs in between
+static void sim_generate_speci(sim_trace_t *trace, time_t start, time_t end) {
+    for (time_t t = start + 20 * 60; t < end; t += 60 * 60) {
+        sim_trace_add(trace, t, sim_random(60, 240));
+        if (rand() % 8 == 0) {
+            time_t speci = t + sim_random(5, 20) * 60;
+            for (int n = sim_random(1, 3); n > 0 && speci < t + 55 * 60; n--, speci += sim_random(5, 15) * 60) {
+                sim_report_t *report = sim_trace_add(trace, speci, sim_random(60, 240));
+                if (report)
+                    report->special = 1;
+            }
+        }
+    }
+    qsort(trace->reports, (size_t)trace->count, sizeof(sim_report_t), sim_report_compare);
+}
+
+// hourly, one in six served 10-25 minutes late
+static void sim_generate_late(sim_trace_t *trace, time_t start, time_t end) {
+    for (time_t t = start + 20 * 60; t < end; t += 60 * 60)
+        sim_trace_add(trace, t, rand() % 6 == 0 ? sim_random(10 * 60, 25 * 60) : sim_random(60, 240));
+}
+
+// hourly, with one upstream outage of 1-3 hours per day
+static void sim_generate_outage(sim_trace_t *trace, time_t start, time_t end) {
+    sim_generate_hourly(trace, start, end);
+    for (time_t day = start; day < end && trace->outage_count < SIM_DAYS * 2; day += 24 * 60 * 60) {
+        const time_t from = day + sim_random(0, 20) * 60 * 60 + sim_random(0, 59) * 60;
+        trace->outages[trace->outage_count][0] = from;
+        trace->outages[trace->outage_count][1] = from + sim_random(60, 180) * 60;
+        trace->outage_count++;
+    }
+}
+
+// TAF issued four times a day, served 1-5 minutes later
+static void sim_generate_taf(sim_trace_t *trace, time_t start, time_t end) {
+    for (time_t t = start + 5 * 60 * 60 + 20 * 60; t < end; t += 6 * 60 * 60)
+        sim_trace_add(trace, t, sim_random(60, 300));
+}
+
+static const sim_scenario_t sim_scenarios[] = {
+    {"hourly", "routine METAR every hour", REPORT_METAR, PRIORITY_NORMAL, sim_generate_hourly},
+    {"half-hourly", "routine METAR every 30 minutes", REPORT_METAR, PRIORITY_NORMAL, sim_generate_half_hourly},
+    {"speci", "hourly METAR with SPECI bursts", REPORT_METAR, PRIORITY_NORMAL, sim_generate_speci},
+    {"late", "hourly METAR, some published late", REPORT_METAR, PRIORITY_NORMAL, sim_generate_late},
+    {"outage", "hourly METAR, daily upstream outage", REPORT_METAR, PRIORITY_NORMAL, sim_generate_outage},
+    {"taf", "TAF every 6 hours", REPORT_TAF, PRIORITY_NORMAL, sim_generate_taf},
+    {"critical", "hourly METAR, critical priority", REPORT_METAR, PRIORITY_CRITICAL, sim_generate_hourly},
+    {"critical-late", "hourly METAR, some published late, critical priority", REPORT_METAR, PRIORITY_CRITICAL, sim_generate_late},
+    {"low", "hourly METAR, low priority", REPORT_METAR, PRIORITY_LOW, sim_generate_hourly},
+};
+
+static int sim_outage(const sim_trace_t *trace, time_t now) {
+    for (int i = 0; i < trace->outage_count; i++)
+        if (now >= trace->outages[i][0] && now < trace->outages[i][1])
+            return 1;
+    return 0;
+}
+
+static void sim_latency(sim_result_t *result, int latency) {
+    if (result->latency_count == result->latency_capacity) {
+        const size_t capacity = result->latency_capacity ? result->latency_capacity * 2 : 1024;
+        int *latencies = realloc(result->latencies, sizeof(int) * capacity);
+        if (!latencies)
+            return;
+        result->latencies = latencies;
+        result->latency_capacity = capacity;
+    }
+    result->latencies[result->latency_count++] = latency;
+}
+
+static void sim_station(const sim_trace_t *trace, time_t start, time_t end, sim_result_t *result) {
+    const char *type = trace->type == REPORT_METAR ? "METAR" : "TAF";
+    const int cap_minutes = trace->type == REPORT_METAR ? METAR_CAP_MINUTES : TAF_CAP_MINUTES;
+    schedule_t sched;
+    memset(&sched, 0, sizeof(sched));
+    schedule_spread(&sched, start, cfg.startup_spread > 0 ? rand() % cfg.startup_spread : 0);
+    int delivered = -1;
+    time_t now = start;
+    for (;;) {
+        // the daemon fetches on the first poll at or after the due time
+        const time_t due = sched.next_fetch > sched.retry_at ? sched.next_fetch : sched.retry_at;
+        if (due > now)
+            now += (due - now + SIM_STEP_SECONDS - 1) / SIM_STEP_SECONDS * SIM_STEP_SECONDS;
+        if (now >= end)
+            break;
+        result->requests++;
+        int latest = delivered;
+        for (int i = delivered + 1; i < trace->count && trace->reports[i].observed <= now; i++)
+            if (trace->reports[i].available <= now)
+                latest = i;
+        if (latest < 0 || sim_outage(trace, now))
+            schedule_failed(&sched, trace->icao, type, now);
+        else {
+            schedule_succeeded(&sched, trace->icao, type);
+            if (schedule_observe(&sched, trace->icao, type, trace->reports[latest].observed, now, cfg.default_interval, cap_minutes, trace->priority,
+                                 trace->reports[latest].special) &&
+                latest > delivered) {
+                sim_latency(result, (int)(now - trace->reports[latest].available));
+                result->missed += (unsigned long)(latest - delivered - 1);
+                delivered = latest;
+            }
+        }
+        now += SIM_STEP_SECONDS;
+    }
+    for (int i = 0; i < trace->count; i++)
+        if (trace->reports[i].available < end) {
+            result->reports++;
+            if (i > delivered)
+                result->missed++;
+        }
+}
+
+static int sim_int_compare(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+static int sim_percentile(const sim_result_t *result, int percent) {
+    if (!result->latency_count)
+        return 0;
+    return result->latencies[(result->latency_count - 1) * (size_t)percent / 100];
+}
+
+static void sim_run(const char *name, sim_trace_t *traces, int trace_count, time_t start, time_t end) {
+    static int header = 0;
+    if (!header++)
+        printf("%-14s %8s %8s %7s %6s %6s %6s %6s %10s\n", "scenario", "req/sd", "rep/sd", "missed", "p50 s", "p90 s", "p99 s", "max s", "speed");
+    sim_result_t result;
+    memset(&result, 0, sizeof(result));
+    const int64_t wall_start = trace_now();
+    for (int i = 0; i < trace_count; i++)
+        sim_station(&traces[i], start, end, &result);
+    const double wall = (double)(trace_now() - wall_start) / 1e6;
+    qsort(result.latencies, result.latency_count, sizeof(int), sim_int_compare);
+    const double station_days = (double)trace_count * (double)(end - start) / (24 * 60 * 60);
+    printf("%-14s %8.1f %8.1f %7lu %6d %6d %6d %6d %9.0fx\n", name, (double)result.requests / station_days, (double)result.reports / station_days, result.missed,
+           sim_percentile(&result, 50), sim_percentile(&result, 90), sim_percentile(&result, 99), sim_percentile(&result, 100),
+           wall > 0 ? (double)(end - start) * trace_count / wall : 0);
+    free(result.latencies);
+}
+
+static void sim_traces_free(sim_trace_t *traces, int trace_count) {
+    for (int i = 0; i < trace_count; i++)
+        free(traces[i].reports);
+    free(traces);
+}
+
+typedef struct {
+    sim_trace_t *traces;
+    int count;
+    time_t first, last;
+} sim_recorded_t;
+
+static void sim_recorded_cb(time_t t, const char *icao, report_type_t type, const char *raw, size_t raw_len, void *userdata) {
+    (void)raw;
+    (void)raw_len;
+    sim_recorded_t *rec = (sim_recorded_t *)userdata;
+    int i = 0;
+    while (i < rec->count && (rec->traces[i].type != type || strcmp(rec->traces[i].icao, icao) != 0))
+        i++;
+    if (i == rec->count) {
+        if (rec->count >= SIM_TRACES)
+            return;
+        snprintf(rec->traces[i].icao, MAX_ICAO, "%s", icao);
+        rec->traces[i].type = type;
+        rec->traces[i].priority = cfg.default_priority;
+        for (int a = 0; a < cfg.airport_count; a++)
+            if (strcmp(cfg.airports[a].icao, icao) == 0)
+                rec->traces[i].priority = cfg.airports[a].priority;
+        rec->count++;
+    }
+    // segments hold issue times only, so publication delay is synthetic
+    sim_trace_add(&rec->traces[i], t, sim_random(60, 240));
+    if (!rec->first || t < rec->first)
+        rec->first = t;
+    if (t > rec->last)
+        rec->last = t;
+}
+
+static int sim_recorded(const char *path) {
+    sim_recorded_t rec = {calloc(SIM_TRACES, sizeof(sim_trace_t)), 0, 0, 0};
+    archive_dict_t *dict = malloc(sizeof(archive_dict_t));
+    const long valid = rec.traces && dict ? archive_scan(path, dict, sim_recorded_cb, &rec) : -1;
+    free(dict);
+    if (valid < 0 || !rec.count) {
+        fprintf(stderr, "simulate: %s: not a readable archive segment\n", path);
+        sim_traces_free(rec.traces, rec.count);
+        return -1;
+    }
+    int records = 0;
+    for (int i = 0; i < rec.count; i++) {
+        qsort(rec.traces[i].reports, (size_t)rec.traces[i].count, sizeof(sim_report_t), sim_report_compare);
+        records += rec.traces[i].count;
+    }
+    const time_t start = rec.first / (60 * 60) * (60 * 60), end = rec.last + 60 * 60;
+    printf("simulate: %s, %d trace(s), %d record(s) over %.1f hour(s)\n", path, rec.count, records, (double)(end - start) / (60 * 60));
+    sim_run("recorded", rec.traces, rec.count, start, end);
+    sim_traces_free(rec.traces, rec.count);
+    return 0;
+}
+
+// runs a named scenario (or "all") over SIM_STATIONS stations for SIM_DAYS days, or replays an archive segment
+static int simulate(const char *what) {
+    opts.all = 0;
+    opts.learn = 1;
+    srand(1);
+    int matched = 0;
+    for (size_t s = 0; s < sizeof(sim_scenarios) / sizeof(sim_scenarios[0]); s++) {
+        const sim_scenario_t *scenario = &sim_scenarios[s];
+        if (strcmp(what, "all") != 0 && strcmp(what, scenario->name) != 0)
+            continue;
+        sim_trace_t *traces = calloc(SIM_STATIONS, sizeof(sim_trace_t));
+        if (!traces)
+            return -1;
+        const time_t start = SIM_EPOCH, end = SIM_EPOCH + SIM_DAYS * 24 * 60 * 60;
+        for (int i = 0; i < SIM_STATIONS; i++) {
+            snprintf(traces[i].icao, MAX_ICAO, "S%03d", i);
+            traces[i].type = scenario->type;
+            traces[i].priority = scenario->priority != PRIORITY_NORMAL ? scenario->priority : cfg.default_priority;
+            scenario->generate(&traces[i], start, end);
+        }
+        debug("simulate: %s (%s)", scenario->name, scenario->description);
+        sim_run(scenario->name, traces, SIM_STATIONS, start, end);
+        sim_traces_free(traces, SIM_STATIONS);
+        matched++;
+    }
+    if (matched)
+        return 0;
+    return sim_recorded(what);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+static void airport_configure(airport_t *a, const cJSON *item, const char *icao) {
+    memset(a, 0, sizeof(airport_t));
+    cJSON *v;
+    if (icao) {
+        strncpy(a->icao, icao, MAX_ICAO - 1);
+        for (char *p = a->icao; *p; p++)
+            *p = (char)toupper(*p);
+    }
+    a->fetch_metar = (v = cJSON_GetObjectItem(item, "fetch_metar")) ? cJSON_IsTrue(v) : cfg.default_metar;
+    a->fetch_taf = (v = cJSON_GetObjectItem(item, "fetch_taf")) ? cJSON_IsTrue(v) : cfg.default_taf;
+    a->interval = (v = cJSON_GetObjectItem(item, "interval_minutes")) ? v->valueint : cfg.default_interval;
+    a->priority = (v = cJSON_GetObjectItem(item, "priority")) ? priority_parse(cJSON_GetStringValue(v), cfg.default_priority) : cfg.default_priority;
+    a->templates = (v = cJSON_GetObjectItem(item, "templates")) ? templates_select(v) : cfg.default_templates;
+    a->owned = !cfg.cluster_enabled;
+    a->last_fetch = 0;
+}
+
+static void config_defaults(void) {
+    memset(&cfg, 0, sizeof(cfg));
+    strcpy(cfg.broker, "localhost");
+    strcpy(cfg.client_id, "avw2mqtt");
+    strcpy(cfg.topic_prefix, "weather/aviation");
+    cfg.protocol_version = MQTT_PROTOCOL_V311;
+    cfg.default_metar = cfg.default_taf = 1;
+    cfg.default_interval = 10;
+    cfg.startup_spread = STARTUP_SPREAD_SECONDS;
+    cfg.recover_seconds = RECOVER_SECONDS;
+    cfg.archive_flush_records = ARCHIVE_FLUSH_RECORDS;
+    cfg.archive_flush_seconds = ARCHIVE_FLUSH_SECONDS;
+    cfg.upstream_timeout = UPSTREAM_TIMEOUT_SECONDS;
+    cfg.upstream_hedge = 1;
+    cfg.cluster_vnodes = CLUSTER_VNODES;
+    cfg.cluster_heartbeat = CLUSTER_HEARTBEAT_SECONDS;
+    cfg.cluster_timeout = CLUSTER_TIMEOUT_SECONDS;
+    cfg.compress_level = COMPRESS_LEVEL;
+    cfg.stationinfo_ttl = STATIONINFO_TTL_DAYS * 24 * 60 * 60;
+}
+
+static int config_load(const char *path) {
+    char *data = read_file(path, "config");
+    if (!data)
+        return -1;
+    cJSON *json = cJSON_Parse(data);
+    free(data);
+    if (!json) {
+        fprintf(stderr, "config: parse error\n");
+        return -1;
+    }
+
+    cJSON *mqtt = cJSON_GetObjectItem(json, "mqtt");
     if (mqtt) {
         const char *s;
         if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(mqtt, "broker"))))
@@ -958,89 +4212,1436 @@ static int config_load(const char *path) {
             strncpy(cfg.password, s, sizeof(cfg.password) - 1);
         if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(mqtt, "stations_file"))))
             strncpy(cfg.stations_file, s, sizeof(cfg.stations_file) - 1);
+        cJSON *v;
+        if ((v = cJSON_GetObjectItem(mqtt, "protocol_version")))
+            cfg.protocol_version = v->valueint;
+        if ((v = cJSON_GetObjectItem(mqtt, "recover_seconds")))
+            cfg.recover_seconds = v->valueint;
+        cfg.compress = (s = cJSON_GetStringValue(cJSON_GetObjectItem(mqtt, "format"))) && strcmp(s, "zstd") == 0;
+    }
+
+    cJSON *broker;
+    cJSON_ArrayForEach(broker, cJSON_GetObjectItem(json, "brokers")) {
+        if (cfg.broker_count >= MAX_BROKERS)
+            break;
+        broker_config_t *b = &cfg.brokers[cfg.broker_count];
+        const char *s;
+        cJSON *v;
+        if (!(s = cJSON_GetStringValue(cJSON_GetObjectItem(broker, "broker")))) {
+            fprintf(stderr, "config: brokers: entry without \"broker\" ignored\n");
+            continue;
+        }
+        strncpy(b->broker, s, sizeof(b->broker) - 1);
+        snprintf(b->client_id, sizeof(b->client_id), "%s", (s = cJSON_GetStringValue(cJSON_GetObjectItem(broker, "client_id"))) ? s : cfg.client_id);
+        snprintf(b->topic_prefix, sizeof(b->topic_prefix), "%s", (s = cJSON_GetStringValue(cJSON_GetObjectItem(broker, "topic_prefix"))) ? s : cfg.topic_prefix);
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(broker, "username"))))
+            strncpy(b->username, s, sizeof(b->username) - 1);
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(broker, "password"))))
+            strncpy(b->password, s, sizeof(b->password) - 1);
+        b->protocol_version = (v = cJSON_GetObjectItem(broker, "protocol_version")) ? v->valueint : MQTT_PROTOCOL_V311;
+        b->compress = (s = cJSON_GetStringValue(cJSON_GetObjectItem(broker, "format"))) && strcmp(s, "zstd") == 0;
+        b->queue = (v = cJSON_GetObjectItem(broker, "queue")) ? v->valueint : BROKER_QUEUE;
+        cfg.broker_count++;
+    }
+
+    cJSON *templates = cJSON_GetObjectItem(json, "templates");
+    if (templates) {
+        if (!cJSON_IsObject(templates)) {
+            fprintf(stderr, "config: \"templates\" must be an object of named templates\n");
+            cJSON_Delete(json);
+            return -1;
+        }
+        cJSON *item;
+        cJSON_ArrayForEach(item, templates) {
+            if (template_parse(item->string, item) < 0) {
+                cJSON_Delete(json);
+                return -1;
+            }
+        }
+        cfg.default_templates = cfg.template_count ? (1u << cfg.template_count) - 1 : 0;
+    }
+
+    cJSON *defaults = cJSON_GetObjectItem(json, "defaults");
+    if (defaults) {
+        cJSON *v;
+        if ((v = cJSON_GetObjectItem(defaults, "fetch_metar")))
+            cfg.default_metar = cJSON_IsTrue(v);
+        if ((v = cJSON_GetObjectItem(defaults, "fetch_taf")))
+            cfg.default_taf = cJSON_IsTrue(v);
+        if ((v = cJSON_GetObjectItem(defaults, "interval_minutes")))
+            cfg.default_interval = v->valueint;
+        if ((v = cJSON_GetObjectItem(defaults, "priority")))
+            cfg.default_priority = priority_parse(cJSON_GetStringValue(v), PRIORITY_NORMAL);
+        if ((v = cJSON_GetObjectItem(defaults, "templates")))
+            cfg.default_templates = templates_select(v);
+    }
+
+    cJSON *history = cJSON_GetObjectItem(json, "history");
+    if (history) {
+        cJSON *v;
+        if ((v = cJSON_GetObjectItem(history, "depth")))
+            cfg.history_depth = v->valueint > HISTORY_MAX ? HISTORY_MAX : v->valueint;
+    }
+
+    cJSON *archive_cfg = cJSON_GetObjectItem(json, "archive");
+    if (archive_cfg) {
+        const char *s;
+        cJSON *v;
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(archive_cfg, "directory"))))
+            strncpy(cfg.archive_directory, s, sizeof(cfg.archive_directory) - 1);
+        if ((v = cJSON_GetObjectItem(archive_cfg, "flush_records")))
+            cfg.archive_flush_records = v->valueint;
+        if ((v = cJSON_GetObjectItem(archive_cfg, "flush_seconds")))
+            cfg.archive_flush_seconds = v->valueint;
+    }
+
+    cJSON *delta = cJSON_GetObjectItem(json, "delta");
+    if (delta) {
+        cJSON *v;
+        cfg.delta_keyframe = (v = cJSON_GetObjectItem(delta, "keyframe_every")) ? v->valueint : DELTA_KEYFRAME;
+    }
+
+    cJSON *snapshot = cJSON_GetObjectItem(json, "snapshot");
+    if (snapshot) {
+        cJSON *v;
+        cfg.snapshot_enabled = (v = cJSON_GetObjectItem(snapshot, "enabled")) ? cJSON_IsTrue(v) : 1;
+        cfg.snapshot_debounce = (v = cJSON_GetObjectItem(snapshot, "debounce_seconds")) ? v->valueint : SNAPSHOT_DEBOUNCE_SECONDS;
+        cfg.snapshot_compress = (v = cJSON_GetObjectItem(snapshot, "compress")) ? cJSON_IsTrue(v) : 1;
+    }
+
+    cJSON *station_info = cJSON_GetObjectItem(json, "stationinfo");
+    if (station_info) {
+        const char *s;
+        cJSON *v;
+        cfg.stationinfo_enabled = (v = cJSON_GetObjectItem(station_info, "enabled")) ? cJSON_IsTrue(v) : 1;
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(station_info, "cache"))))
+            strncpy(cfg.stationinfo_cache, s, sizeof(cfg.stationinfo_cache) - 1);
+        if ((v = cJSON_GetObjectItem(station_info, "ttl_days")))
+            cfg.stationinfo_ttl = v->valueint * 24 * 60 * 60;
+    }
+
+    cJSON *on_demand = cJSON_GetObjectItem(json, "on_demand");
+    if (on_demand) {
+        cJSON *v;
+        cfg.ondemand_ttl = (v = cJSON_GetObjectItem(on_demand, "ttl_seconds")) ? v->valueint : ONDEMAND_TTL_SECONDS;
+        cfg.ondemand_workers = (v = cJSON_GetObjectItem(on_demand, "workers")) ? v->valueint : ONDEMAND_WORKERS;
+    }
+
+    cJSON *cluster = cJSON_GetObjectItem(json, "cluster");
+    if (cluster) {
+        const char *s;
+        cJSON *v;
+        cfg.cluster_enabled = (v = cJSON_GetObjectItem(cluster, "enabled")) ? cJSON_IsTrue(v) : 1;
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(cluster, "node"))))
+            strncpy(cfg.cluster_node, s, sizeof(cfg.cluster_node) - 1);
+        if ((v = cJSON_GetObjectItem(cluster, "virtual_nodes")))
+            cfg.cluster_vnodes = v->valueint;
+        if ((v = cJSON_GetObjectItem(cluster, "heartbeat_seconds")))
+            cfg.cluster_heartbeat = v->valueint;
+        if ((v = cJSON_GetObjectItem(cluster, "timeout_seconds")))
+            cfg.cluster_timeout = v->valueint;
+    }
+
+    cJSON *compression = cJSON_GetObjectItem(json, "compression");
+    if (compression) {
+        const char *s;
+        cJSON *v;
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(compression, "dictionary"))))
+            strncpy(cfg.compress_dictionary, s, sizeof(cfg.compress_dictionary) - 1);
+        if ((v = cJSON_GetObjectItem(compression, "level")))
+            cfg.compress_level = v->valueint;
+        if ((v = cJSON_GetObjectItem(compression, "topic")))
+            cfg.compress_topic = cJSON_IsTrue(v);
+    }
+
+    cJSON *shm = cJSON_GetObjectItem(json, "shm");
+    if (shm) {
+        const char *s;
+        if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(shm, "name"))))
+            strncpy(cfg.shm_name, s, sizeof(cfg.shm_name) - 1);
+    }
+
+    cJSON *upstream = cJSON_GetObjectItem(json, "upstream");
+    if (upstream) {
+        cJSON *v, *item;
+        cJSON_ArrayForEach(item, cJSON_GetObjectItem(upstream, "endpoints")) {
+            const char *s = cJSON_GetStringValue(item);
+            if (s && cfg.endpoint_count < MAX_ENDPOINTS)
+                snprintf(cfg.endpoints[cfg.endpoint_count++].base, MAX_URL, "%s", s);
+        }
+        if ((v = cJSON_GetObjectItem(upstream, "timeout_seconds")))
+            cfg.upstream_timeout = v->valueint;
+        if ((v = cJSON_GetObjectItem(upstream, "hedge")))
+            cfg.upstream_hedge = cJSON_IsTrue(v);
+    }
+    if (!cfg.endpoint_count)
+        snprintf(cfg.endpoints[cfg.endpoint_count++].base, MAX_URL, "%s", UPSTREAM_DEFAULT);
+
+    cJSON *limits = cJSON_GetObjectItem(json, "limits");
+    if (limits) {
+        cJSON *v;
+        if ((v = cJSON_GetObjectItem(limits, "requests_per_minute")))
+            cfg.rate_per_minute = v->valuedouble;
+        if ((v = cJSON_GetObjectItem(limits, "burst")))
+            cfg.rate_burst = v->valuedouble;
+        if ((v = cJSON_GetObjectItem(limits, "startup_spread_seconds")))
+            cfg.startup_spread = v->valueint;
+    }
+
+    const cJSON *regions = cJSON_GetObjectItem(json, "regions");
+    if (regions && cJSON_IsArray(regions))
+        cfg.regions = cJSON_Duplicate(regions, 1);
+
+    const cJSON *airports = cJSON_GetObjectItem(json, "airports");
+    if (airports && cJSON_IsArray(airports)) {
+        cJSON *ap;
+        cJSON_ArrayForEach(ap, airports) {
+            if (cfg.airport_count >= MAX_AIRPORTS)
+                break;
+            airport_configure(&cfg.airports[cfg.airport_count], ap, cJSON_GetStringValue(cJSON_GetObjectItem(ap, "icao")));
+            cfg.airport_count++;
+        }
+    }
+
+    if (!cfg.cluster_node[0])
+        memcpy(cfg.cluster_node, cfg.client_id, sizeof(cfg.cluster_node));
+
+    cJSON_Delete(json);
+    return 0;
+}
+
+static void airports_spread(int fresh_only) {
+    const time_t now = time(NULL);
+    const int step = cfg.airport_count > 0 ? cfg.startup_spread * 1000 / cfg.airport_count : 0;
+    for (int i = 0; i < cfg.airport_count; i++) {
+        airport_t *ap = &cfg.airports[i];
+        if (fresh_only && ap->last_fetch != 0)
+            continue;
+        const int offset = (step * i + (step > 0 ? rand() % step : 0)) / 1000;
+        schedule_spread(&ap->sched_metar, now, offset);
+        schedule_spread(&ap->sched_taf, now, offset);
+    }
+    debug("airports: initial fetches spread over %d seconds", cfg.startup_spread);
+}
+
+static void airports_build_json(void) {
+    for (int i = 0; i < cfg.airport_count; i++) {
+        airport_t *ap = &cfg.airports[i];
+        ap->json = cJSON_CreateObject();
+        cJSON_AddStringToObject(ap->json, "icao", ap->icao);
+        if (ap->name[0]) {
+            cJSON_AddStringToObject(ap->json, "name", ap->name);
+            cJSON_AddNumberToObject(ap->json, "lat", ap->lat);
+            cJSON_AddNumberToObject(ap->json, "lon", ap->lon);
+            cJSON_AddNumberToObject(ap->json, "elev", ap->elev);
+        }
+        if (ap->country[0])
+            cJSON_AddStringToObject(ap->json, "country", ap->country);
+    }
+}
+static void airports_free(void) {
+    for (int i = 0; i < cfg.airport_count; i++) {
+        if (cfg.airports[i].json)
+            cJSON_Delete(cfg.airports[i].json);
+        history_free(&cfg.airports[i]);
+        delta_free(&cfg.airports[i]);
+        snapshot_free(&cfg.airports[i]);
+        if (cfg.airports[i].taf_timeline)
+            cJSON_Delete(cfg.airports[i].taf_timeline);
+    }
+    if (cfg.regions)
+        cJSON_Delete(cfg.regions);
+    stations_free();
+}
+
+static airport_t *airport_find(const char *icao) {
+    for (int i = 0; i < cfg.airport_count; i++)
+        if (strcmp(cfg.airports[i].icao, icao) == 0)
+            return &cfg.airports[i];
+    return NULL;
+}
+
+static void airports_match_stations(void) {
+    for (int i = 0; i < cfg.airport_count; i++) {
+        airport_t *ap = &cfg.airports[i];
+        const station_t *st = station_find(ap->icao);
+        if (st) {
+            debug("[%s] loaded from stations file: '%s'", st->icao, st->name);
+            memcpy(ap->name, st->name, sizeof(ap->name));
+            memcpy(ap->country, st->country, sizeof(ap->country));
+            ap->lat = st->lat;
+            ap->lon = st->lon;
+            ap->elev = st->elev_km * 1000; // metres
+        }
+    }
+}
+
+static void region_add_cb(const station_t *st, double distance_km, void *userdata) {
+    const cJSON *region = (const cJSON *)userdata;
+    if (airport_find(st->icao))
+        return;
+    if (cfg.airport_count >= MAX_AIRPORTS) {
+        debug("[%s] region: not added, airports limit (%d) reached", st->icao, MAX_AIRPORTS);
+        return;
+    }
+    airport_configure(&cfg.airports[cfg.airport_count++], region, st->icao);
+    debug("[%s] region: added '%s' (%.0f km)", st->icao, st->name, distance_km);
+}
+
+static void regions_expand(void) {
+    cJSON *region;
+    int index = 0;
+    cJSON_ArrayForEach(region, cfg.regions) {
+        const int before = cfg.airport_count;
+        const cJSON *bbox = cJSON_GetObjectItem(region, "bbox");
+        const cJSON *lat = cJSON_GetObjectItem(region, "lat"), *lon = cJSON_GetObjectItem(region, "lon");
+        cJSON *v;
+        if (bbox && cJSON_GetArraySize(bbox) == 4) {
+            const double lat_min = cJSON_GetArrayItem(bbox, 0)->valuedouble, lon_min = cJSON_GetArrayItem(bbox, 1)->valuedouble;
+            const double lat_max = cJSON_GetArrayItem(bbox, 2)->valuedouble, lon_max = cJSON_GetArrayItem(bbox, 3)->valuedouble;
+            for (int i = 0; i < station_count; i++) {
+                const station_t *st = &stations[i];
+                const int lon_in = lon_min <= lon_max ? (st->lon >= lon_min && st->lon <= lon_max) : (st->lon >= lon_min || st->lon <= lon_max);
+                if (lon_in && st->lat >= lat_min && st->lat <= lat_max)
+                    region_add_cb(st, 0, region);
+            }
+        } else if (lat && lon && (v = cJSON_GetObjectItem(region, "radius_km"))) {
+            stations_within(lat->valuedouble, lon->valuedouble, v->valuedouble, region_add_cb, region);
+        } else if (lat && lon && (v = cJSON_GetObjectItem(region, "nearest"))) {
+            int best[MAX_NEAREST];
+            double best_km[MAX_NEAREST];
+            const int found = stations_nearest(lat->valuedouble, lon->valuedouble, v->valueint, best, best_km);
+            for (int i = 0; i < found; i++)
+                region_add_cb(&stations[best[i]], best_km[i], region);
+        } else {
+            fprintf(stderr, "regions: entry %d needs 'bbox', or 'lat'/'lon' with 'radius_km' or 'nearest'\n", index);
+        }
+        debug("regions: entry %d expanded to %d airport(s)", index, cfg.airport_count - before);
+        index++;
+    }
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+static stationinfo_t *stationinfo_find(const char *icao) {
+    for (int i = 0; i < stationinfo_count; i++)
+        if (strcmp(stationinfo[i].station.icao, icao) == 0)
+            return &stationinfo[i];
+    return NULL;
+}
+
+static void stationinfo_put(const stationinfo_t *entry) {
+    stationinfo_t *e = stationinfo_find(entry->station.icao);
+    if (!e) {
+        if (stationinfo_count >= stationinfo_capacity) {
+            const int capacity = stationinfo_capacity ? stationinfo_capacity * 2 : 64;
+            stationinfo_t *tmp = realloc(stationinfo, sizeof(stationinfo_t) * (size_t)capacity);
+            if (!tmp)
+                return;
+            stationinfo = tmp;
+            stationinfo_capacity = capacity;
+        }
+        e = &stationinfo[stationinfo_count++];
+    }
+    *e = *entry;
+}
+
+// cache file: magic line, then one tab-separated line per station: icao fetched found lat lon elev_m country name
+static void stationinfo_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        if (errno != ENOENT)
+            fprintf(stderr, "stationinfo: cannot read %s: %s\n", path, strerror(errno));
+        return;
+    }
+    char line[512];
+    if (!fgets(line, sizeof(line), f) || strncmp(line, STATIONINFO_MAGIC, strlen(STATIONINFO_MAGIC)) != 0) {
+        fprintf(stderr, "stationinfo: %s is not a stationinfo cache, ignored\n", path);
+        fclose(f);
+        return;
+    }
+    int count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *fields[8], *p = line;
+        int n = 0;
+        for (; n < 8 && p; n++) {
+            fields[n] = p;
+            if ((p = strchr(p, '\t')))
+                *p++ = '\0';
+        }
+        if (n < 8 || !fields[0][0] || strlen(fields[0]) >= MAX_ICAO)
+            continue;
+        stationinfo_t e;
+        memset(&e, 0, sizeof(e));
+        memcpy(e.station.icao, fields[0], strlen(fields[0]));
+        e.fetched = (time_t)strtoll(fields[1], NULL, 10);
+        e.found = atoi(fields[2]);
+        e.station.lat = strtod(fields[3], NULL);
+        e.station.lon = strtod(fields[4], NULL);
+        e.station.elev_km = strtod(fields[5], NULL) / 1000;
+        snprintf(e.station.country, sizeof(e.station.country), "%.7s", fields[6]);
+        snprintf(e.station.name, sizeof(e.station.name), "%.127s", fields[7]);
+        stationinfo_put(&e);
+        count++;
+    }
+    fclose(f);
+    printf("stationinfo: loaded %d station(s) from %s\n", count, path);
+}
+
+static void stationinfo_save(const char *path) {
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "stationinfo: cannot write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    fprintf(f, "%s\n", STATIONINFO_MAGIC);
+    for (int i = 0; i < stationinfo_count; i++) {
+        const stationinfo_t *e = &stationinfo[i];
+        fprintf(f, "%s\t%lld\t%d\t%.4f\t%.4f\t%.0f\t%s\t%s\n", e->station.icao, (long long)e->fetched, e->found, e->station.lat, e->station.lon,
+                e->station.elev_km * 1000, e->station.country, e->station.name);
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+        fprintf(stderr, "stationinfo: cannot write %s: %s\n", path, strerror(errno));
+    else
+        debug("stationinfo: saved %d station(s) to %s", stationinfo_count, path);
+}
+
+// one request for a batch of ICAOs; returns how many the upstream knew, -1 if the request failed
+static int stationinfo_fetch(char icaos[][MAX_ICAO], int count) {
+    char path[MAX_URL];
+    size_t n = (size_t)snprintf(path, sizeof(path), "/stationinfo?format=json&ids=");
+    for (int i = 0; i < count && n < sizeof(path); i++)
+        n += (size_t)snprintf(path + n, sizeof(path) - n, "%s%s", i ? "," : "", icaos[i]);
+    if (!ratelimit_take(&ratelimit, PRIORITY_LOW))
+        return -1;
+    char *data = fetch_upstream(path, "stationinfo", PRIORITY_LOW);
+    if (!data)
+        return -1;
+    cJSON *json = cJSON_Parse(data);
+    free(data);
+    if (!cJSON_IsArray(json)) {
+        debug("stationinfo: unexpected response");
+        if (json)
+            cJSON_Delete(json);
+        return -1;
+    }
+    const time_t now = time(NULL);
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        stationinfo_t e;
+        memset(&e, 0, sizeof(e));
+        memcpy(e.station.icao, icaos[i], MAX_ICAO);
+        e.fetched = now;
+        const cJSON *item;
+        cJSON_ArrayForEach(item, json) {
+            const char *id = cJSON_GetStringValue(cJSON_GetObjectItem(item, "icaoId"));
+            if (!id || strcasecmp(id, icaos[i]) != 0)
+                continue;
+            const char *s;
+            const cJSON *v;
+            if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(item, "site"))))
+                snprintf(e.station.name, sizeof(e.station.name), "%s", s);
+            if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(item, "country"))))
+                snprintf(e.station.country, sizeof(e.station.country), "%s", s);
+            if ((v = cJSON_GetObjectItem(item, "lat")) && cJSON_IsNumber(v))
+                e.station.lat = v->valuedouble;
+            if ((v = cJSON_GetObjectItem(item, "lon")) && cJSON_IsNumber(v))
+                e.station.lon = v->valuedouble;
+            if ((v = cJSON_GetObjectItem(item, "elev")) && cJSON_IsNumber(v))
+                e.station.elev_km = v->valuedouble / 1000; // metres
+            e.found = e.station.name[0] != '\0';
+            break;
+        }
+        debug("[%s] stationinfo: %s", e.station.icao, e.found ? e.station.name : "unknown upstream");
+        found += e.found;
+        stationinfo_put(&e);
+    }
+    cJSON_Delete(json);
+    return found;
+}
+
+// fetches metadata for configured airports the stations file does not know: those not cached yet and, with 'refresh', those past
+// the TTL; cached entries are used as they are until then, so only a first run waits on the network. Returns stations fetched.
+static int stationinfo_resolve(int refresh) {
+    char batch[STATIONINFO_BATCH][MAX_ICAO];
+    int count = 0, fetched = 0;
+    const time_t now = time(NULL);
+    stationinfo_check_at = now + STATIONINFO_CHECK_SECONDS;
+    for (int i = 0; i <= cfg.airport_count; i++) {
+        if (i < cfg.airport_count) {
+            const airport_t *ap = &cfg.airports[i];
+            const stationinfo_t *e = stationinfo_find(ap->icao);
+            if (station_find(ap->icao) || (e && (!refresh || now - e->fetched < cfg.stationinfo_ttl)))
+                continue;
+            memcpy(batch[count++], ap->icao, MAX_ICAO);
+        }
+        if (count > 0 && (count == STATIONINFO_BATCH || i == cfg.airport_count)) {
+            const int found = stationinfo_fetch(batch, count);
+            if (found < 0)
+                fprintf(stderr, "stationinfo: request for %d station(s) failed, retry in %d seconds\n", count, STATIONINFO_CHECK_SECONDS);
+            else {
+                debug("stationinfo: %d of %d station(s) known upstream", found, count);
+                fetched += count;
+            }
+            count = 0;
+        }
+    }
+    if (fetched > 0 && cfg.stationinfo_cache[0])
+        stationinfo_save(cfg.stationinfo_cache);
+    return fetched;
+}
+
+static void airports_match_stationinfo(void) {
+    for (int i = 0; i < cfg.airport_count; i++) {
+        airport_t *ap = &cfg.airports[i];
+        const stationinfo_t *e = station_find(ap->icao) ? NULL : stationinfo_find(ap->icao);
+        if (e && e->found) {
+            debug("[%s] loaded from stationinfo: '%s'", ap->icao, e->station.name);
+            memcpy(ap->name, e->station.name, sizeof(ap->name));
+            memcpy(ap->country, e->station.country, sizeof(ap->country));
+            ap->lat = e->station.lat;
+            ap->lon = e->station.lon;
+            ap->elev = e->station.elev_km * 1000; // metres
+        }
+    }
+}
+
+static void stationinfo_update(int refresh) {
+    if (!cfg.stationinfo_enabled || time(NULL) < stationinfo_check_at || stationinfo_resolve(refresh) == 0)
+        return;
+    pthread_mutex_lock(&state_mutex);
+    airports_match_stationinfo();
+    for (int i = 0; i < cfg.airport_count; i++)
+        if (cfg.airports[i].json) {
+            cJSON_Delete(cfg.airports[i].json);
+            cfg.airports[i].json = NULL;
+        }
+    airports_build_json();
+    pthread_mutex_unlock(&state_mutex);
+}
+
+static void stationinfo_free(void) {
+    free(stationinfo);
+    stationinfo = NULL;
+    stationinfo_count = stationinfo_capacity = 0;
+}
+
+static void airports_setup(void) {
+    stations_free();
+    if (cfg.stations_file[0] && stations_load(cfg.stations_file, station_collect_cb, NULL) == 0)
+        stations_index();
+    if (cfg.regions) {
+        if (!station_count)
+            fprintf(stderr, "regions: no stations file loaded, regions ignored\n");
+        regions_expand();
+    }
+    airports_match_stations();
+    airports_match_stationinfo();
+    airports_build_json();
+}
+
+static void config_reload(void) {
+    static config_t previous;
+    pthread_mutex_lock(&state_mutex);
+    previous = cfg;
+    config_defaults();
+    if (config_load(opts.config_path) < 0) {
+        cfg = previous;
+        pthread_mutex_unlock(&state_mutex);
+        fprintf(stderr, "config: reload failed, keeping previous\n");
+        return;
+    }
+    // connection settings only apply at startup
+    memcpy(cfg.broker, previous.broker, sizeof(cfg.broker));
+    memcpy(cfg.client_id, previous.client_id, sizeof(cfg.client_id));
+    memcpy(cfg.topic_prefix, previous.topic_prefix, sizeof(cfg.topic_prefix));
+    memcpy(cfg.username, previous.username, sizeof(cfg.username));
+    memcpy(cfg.password, previous.password, sizeof(cfg.password));
+    cfg.protocol_version = previous.protocol_version;
+    cfg.history_depth = previous.history_depth;
+    cfg.ondemand_workers = previous.ondemand_workers;
+    cfg.cluster_enabled = previous.cluster_enabled;
+    memcpy(cfg.cluster_node, previous.cluster_node, sizeof(cfg.cluster_node));
+    memcpy(cfg.archive_directory, previous.archive_directory, sizeof(cfg.archive_directory));
+    memcpy(cfg.shm_name, previous.shm_name, sizeof(cfg.shm_name));
+    memcpy(cfg.brokers, previous.brokers, sizeof(cfg.brokers));
+    cfg.broker_count = previous.broker_count;
+    memcpy(cfg.compress_dictionary, previous.compress_dictionary, sizeof(cfg.compress_dictionary));
+    cfg.compress_level = previous.compress_level;
+    cfg.compress_topic = previous.compress_topic;
+    pthread_mutex_lock(&upstream_mutex);
+    memcpy(cfg.endpoints, previous.endpoints, sizeof(cfg.endpoints));
+    cfg.endpoint_count = previous.endpoint_count;
+    pthread_mutex_unlock(&upstream_mutex);
+    airports_setup();
+    for (int i = 0; i < cfg.airport_count; i++)
+        cfg.airports[i].owned = !cfg.cluster_enabled;
+    if (cfg.cluster_enabled) {
+        pthread_mutex_lock(&cluster_mutex);
+        cluster_changed = 1;
+        pthread_mutex_unlock(&cluster_mutex);
+    }
+    int carried = 0;
+    for (int i = 0; i < previous.airport_count; i++) {
+        airport_t *from = &previous.airports[i];
+        airport_t *to = airport_find(from->icao);
+        if (to) {
+            to->sched_metar = from->sched_metar;
+            to->sched_taf = from->sched_taf;
+            to->last_fetch = from->last_fetch;
+            to->history = from->history;
+            to->taf_timeline = from->taf_timeline;
+            to->taf_changes = from->taf_changes;
+            memcpy(to->delta, from->delta, sizeof(to->delta));
+            memcpy(to->latest, from->latest, sizeof(to->latest));
+            from->taf_timeline = NULL;
+            memset(&from->history, 0, sizeof(from->history));
+            memset(from->delta, 0, sizeof(from->delta));
+            memset(from->latest, 0, sizeof(from->latest));
+            carried++;
+        }
+        if (from->json)
+            cJSON_Delete(from->json);
+        history_free(from);
+        delta_free(from);
+        snapshot_free(from);
+        if (from->taf_timeline)
+            cJSON_Delete(from->taf_timeline);
     }
+    if (previous.regions)
+        cJSON_Delete(previous.regions);
+    ratelimit_init(&ratelimit, cfg.rate_per_minute, cfg.rate_burst);
+    airports_spread(1);
+    pthread_mutex_unlock(&state_mutex);
+    if (cfg.snapshot_enabled && !snapshot_changed)
+        snapshot_changed = time(NULL); // airports may have been dropped
+    printf("config: reloaded, %d airport(s) (%d carried over)\n", cfg.airport_count, carried);
+}
 
-    cJSON *defaults = cJSON_GetObjectItem(json, "defaults");
-    if (defaults) {
-        cJSON *v;
-        if ((v = cJSON_GetObjectItem(defaults, "fetch_metar")))
-            cfg.default_metar = cJSON_IsTrue(v);
-        if ((v = cJSON_GetObjectItem(defaults, "fetch_taf")))
-            cfg.default_taf = cJSON_IsTrue(v);
-        if ((v = cJSON_GetObjectItem(defaults, "interval_minutes")))
-            cfg.default_interval = v->valueint;
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+static void mqtt_respond(const char *topic, const cJSON *root, const void *correlation, uint16_t correlation_len) {
+    char *payload = cJSON_PrintUnformatted(root);
+    if (cfg.protocol_version == MQTT_PROTOCOL_V5) {
+        mosquitto_property *props = NULL;
+        mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, "application/json");
+        if (correlation)
+            mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, correlation, correlation_len);
+        mosquitto_publish_v5(mosq, NULL, topic, (int)strlen(payload), payload, 0, false, props);
+        mosquitto_property_free_all(&props);
+    } else
+        mosquitto_publish(mosq, NULL, topic, (int)strlen(payload), payload, 0, false);
+    free(payload);
+}
+
+// looks the airport up under the same lock, a reload can move cfg.airports at any time; empty if no longer configured
+static cJSON *history_query(const char *icao, int type, time_t since, int limit) {
+    cJSON *array = cJSON_CreateArray();
+    pthread_mutex_lock(&state_mutex);
+    const airport_t *ap = airport_find(icao);
+    if (!ap) {
+        pthread_mutex_unlock(&state_mutex);
+        return array;
+    }
+    const history_t *h = &ap->history;
+    int indexes[HISTORY_MAX], matched = 0;
+    for (int i = 0; i < h->count; i++) {
+        const int index = (h->head + cfg.history_depth - h->count + i) % cfg.history_depth;
+        const history_record_t *r = &h->records[index];
+        if ((type < 0 || r->type == (report_type_t)type) && r->time >= since)
+            indexes[matched++] = index;
+    }
+    for (int i = (limit > 0 && matched > limit) ? matched - limit : 0; i < matched; i++) {
+        const history_record_t *r = &h->records[indexes[i]];
+        char timestamp[32];
+        struct tm tm;
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&r->time, &tm));
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "type", report_type_str(r->type));
+        cJSON_AddStringToObject(item, r->type == REPORT_TAF ? "issued" : "observed", timestamp);
+        if (r->raw)
+            cJSON_AddStringToObject(item, "raw", r->raw->str);
+        if (r->text)
+            cJSON_AddStringToObject(item, "text", r->text->str);
+        cJSON_AddItemToArray(array, item);
     }
+    pthread_mutex_unlock(&state_mutex);
+    return array;
+}
 
-    const cJSON *airports = cJSON_GetObjectItem(json, "airports");
-    if (airports && cJSON_IsArray(airports)) {
-        cJSON *ap;
-        cJSON_ArrayForEach(ap, airports) {
-            if (cfg.airport_count >= MAX_AIRPORTS)
-                break;
-            airport_t *a = &cfg.airports[cfg.airport_count];
-            memset(a, 0, sizeof(airport_t));
-            cJSON *v;
-            const char *s;
-            if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(ap, "icao")))) {
-                strncpy(a->icao, s, MAX_ICAO - 1);
-                for (char *p = a->icao; *p; p++)
-                    *p = (char)toupper(*p);
-            }
-            a->fetch_metar = (v = cJSON_GetObjectItem(ap, "fetch_metar")) ? cJSON_IsTrue(v) : cfg.default_metar;
-            a->fetch_taf = (v = cJSON_GetObjectItem(ap, "fetch_taf")) ? cJSON_IsTrue(v) : cfg.default_taf;
-            a->interval = (v = cJSON_GetObjectItem(ap, "interval_minutes")) ? v->valueint : cfg.default_interval;
-            a->last_fetch = 0;
-            cfg.airport_count++;
+// a response topic named in the payload (which, unlike the v5 property, any client can set) must stay below our prefix
+static int response_topic_allowed(const char *topic) {
+    const size_t length = strlen(cfg.topic_prefix);
+    return strncmp(topic, cfg.topic_prefix, length) == 0 && topic[length] == '/' && topic[length + 1] && !strpbrk(topic, "+#");
+}
+
+static void history_request(const char *icao, const cJSON *request, const mosquitto_property *props) {
+    pthread_mutex_lock(&state_mutex);
+    const int known = airport_find(icao) != NULL;
+    pthread_mutex_unlock(&state_mutex);
+    if (!known)
+        return;
+    int type = -1, limit = 0;
+    time_t since = 0;
+    const char *s, *type_name = cJSON_GetStringValue(cJSON_GetObjectItem(request, "type"));
+    cJSON *v;
+    if (type_name)
+        type = strcmp(type_name, "taf") == 0 ? REPORT_TAF : strcmp(type_name, "metar") == 0 ? REPORT_METAR : -2;
+    if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(request, "since"))))
+        since = parse_iso_time(s);
+    if ((v = cJSON_GetObjectItem(request, "limit")))
+        limit = v->valueint;
+
+    char topic[MAX_TOPIC];
+    char *response_topic = NULL;
+    void *correlation = NULL;
+    uint16_t correlation_len = 0;
+    mosquitto_property_read_string(props, MQTT_PROP_RESPONSE_TOPIC, &response_topic, false);
+    mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &correlation, &correlation_len, false);
+    if (response_topic)
+        snprintf(topic, sizeof(topic), "%s", response_topic);
+    else if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(request, "response_topic")))) {
+        if (!response_topic_allowed(s)) {
+            debug("[%s] history: request with response topic '%s' outside %s ignored", icao, s, cfg.topic_prefix);
+            free(correlation);
+            return;
         }
+        snprintf(topic, sizeof(topic), "%s", s);
+    } else
+        snprintf(topic, sizeof(topic), "%s/%s/history/res", cfg.topic_prefix, icao);
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "icao", icao);
+    if ((v = cJSON_GetObjectItem(request, "correlation")))
+        cJSON_AddItemToObject(root, "correlation", cJSON_Duplicate(v, 1));
+    if (type == -2) {
+        debug("[%s] history: request for unknown type '%s' rejected", icao, type_name);
+        cJSON_AddStringToObject(root, "error", "unknown type");
+    } else {
+        cJSON *items = history_query(icao, type, since, limit);
+        debug("[%s] history: request answered with %d item(s) to %s", icao, cJSON_GetArraySize(items), topic);
+        cJSON_AddItemToObject(root, "history", items);
     }
+    mqtt_respond(topic, root, correlation, correlation_len);
+    cJSON_Delete(root);
+    free(response_topic);
+    free(correlation);
+}
 
-    cJSON_Delete(json);
-    return 0;
+static int ondemand_icao_valid(const char *icao) {
+    const size_t length = strlen(icao);
+    if (length < 3 || length >= MAX_ICAO)
+        return 0;
+    for (const char *p = icao; *p; p++)
+        if (!isalnum((unsigned char)*p))
+            return 0;
+    return 1;
 }
 
-static void airports_build_json(void) {
-    for (int i = 0; i < cfg.airport_count; i++) {
-        airport_t *ap = &cfg.airports[i];
-        ap->json = cJSON_CreateObject();
-        cJSON_AddStringToObject(ap->json, "icao", ap->icao);
-        if (ap->name[0]) {
-            cJSON_AddStringToObject(ap->json, "name", ap->name);
-            cJSON_AddNumberToObject(ap->json, "lat", ap->lat);
-            cJSON_AddNumberToObject(ap->json, "lon", ap->lon);
-            cJSON_AddNumberToObject(ap->json, "elev", ap->elev);
-        }
-        if (ap->country[0])
-            cJSON_AddStringToObject(ap->json, "country", ap->country);
+static void ondemand_request_free(ondemand_request_t *request) {
+    cJSON_Delete(request->root);
+    free(request->correlation);
+    free(request);
+}
+
+static void ondemand_respond(ondemand_request_t *request) {
+    debug("[%s] fetch: request answered to %s", request->icao, request->topic);
+    mqtt_respond(request->topic, request->root, request->correlation, request->correlation_len);
+    ondemand_request_free(request);
+}
+
+// caller holds ondemand_mutex; returns the entry for icao/type, reusing the least recently fetched idle entry when full
+static ondemand_entry_t *ondemand_entry(const char *icao, report_type_t type) {
+    ondemand_entry_t *victim = NULL;
+    for (int i = 0; i < ONDEMAND_ENTRIES; i++) {
+        ondemand_entry_t *entry = &ondemand_entries[i];
+        if (entry->icao[0] && entry->type == type && strcmp(entry->icao, icao) == 0)
+            return entry;
+        if (!entry->in_flight && !entry->waiters && (!victim || entry->fetched_at < victim->fetched_at))
+            victim = entry;
     }
+    if (!victim)
+        return NULL;
+    if (victim->result)
+        cJSON_Delete(victim->result);
+    memset(victim, 0, sizeof(*victim));
+    snprintf(victim->icao, sizeof(victim->icao), "%s", icao);
+    victim->type = type;
+    return victim;
 }
-static void airports_free(void) {
-    for (int i = 0; i < cfg.airport_count; i++)
-        if (cfg.airports[i].json)
-            cJSON_Delete(cfg.airports[i].json);
+
+static void ondemand_attach(ondemand_entry_t *entry, ondemand_request_t *request) {
+    ondemand_waiter_t *waiter = malloc(sizeof(ondemand_waiter_t));
+    if (!waiter)
+        return;
+    waiter->request = request;
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+    request->pending++;
 }
 
-static void station_match_cb(const station_t *st, void *userdata) {
-    (void)userdata;
-    for (int i = 0; i < cfg.airport_count; i++) {
-        airport_t *ap = &cfg.airports[i];
-        if (strcmp(ap->icao, st->icao) == 0) {
-            debug("[%s] loaded from stations file: '%s'", st->icao, st->name);
+static void ondemand_request(const char *icao_in, const cJSON *request_json, const mosquitto_property *props) {
+    if (!ondemand_icao_valid(icao_in)) {
+        debug("fetch: request for invalid ICAO '%s' ignored", icao_in);
+        return;
+    }
+    char icao[MAX_ICAO] = {0};
+    for (size_t i = 0; icao_in[i]; i++)
+        icao[i] = (char)toupper(icao_in[i]);
+    const char *s;
+    int types = (1 << REPORT_METAR) | (1 << REPORT_TAF);
+    if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(request_json, "type"))))
+        types = strcmp(s, "taf") == 0 ? (1 << REPORT_TAF) : strcmp(s, "metar") == 0 ? (1 << REPORT_METAR) : types;
+
+    ondemand_request_t *request = calloc(1, sizeof(ondemand_request_t));
+    if (!request)
+        return;
+    snprintf(request->icao, sizeof(request->icao), "%s", icao);
+    char *response_topic = NULL;
+    mosquitto_property_read_string(props, MQTT_PROP_RESPONSE_TOPIC, &response_topic, false);
+    mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &request->correlation, &request->correlation_len, false);
+    if (response_topic)
+        snprintf(request->topic, sizeof(request->topic), "%s", response_topic);
+    else if ((s = cJSON_GetStringValue(cJSON_GetObjectItem(request_json, "response_topic")))) {
+        if (!response_topic_allowed(s)) {
+            debug("[%s] fetch: request with response topic '%s' outside %s ignored", icao, s, cfg.topic_prefix);
+            free(request->correlation);
+            free(request);
+            return;
+        }
+        snprintf(request->topic, sizeof(request->topic), "%s", s);
+    } else
+        snprintf(request->topic, sizeof(request->topic), "%s/%s/%s/res", cfg.topic_prefix, ONDEMAND_TOPIC, icao);
+    free(response_topic);
+    request->root = cJSON_CreateObject();
+    cJSON_AddStringToObject(request->root, "icao", icao);
+    const cJSON *v;
+    if ((v = cJSON_GetObjectItem(request_json, "correlation")))
+        cJSON_AddItemToObject(request->root, "correlation", cJSON_Duplicate(v, 1));
+
+    pthread_mutex_lock(&state_mutex);
+    const airport_t *configured = airport_find(icao);
+    const station_t *st = station_find(icao);
+    if (configured && configured->json)
+        cJSON_AddItemToObject(request->root, "airport", cJSON_Duplicate(configured->json, 1));
+    else if (st) {
+        cJSON *airport = cJSON_AddObjectToObject(request->root, "airport");
+        cJSON_AddStringToObject(airport, "icao", st->icao);
+        cJSON_AddStringToObject(airport, "name", st->name);
+        cJSON_AddNumberToObject(airport, "lat", st->lat);
+        cJSON_AddNumberToObject(airport, "lon", st->lon);
+        cJSON_AddNumberToObject(airport, "elev", st->elev_km * 1000);
+        if (st->country[0])
+            cJSON_AddStringToObject(airport, "country", st->country);
+    }
+    pthread_mutex_unlock(&state_mutex);
+
+    const time_t now = time(NULL);
+    int cached = 0;
+    pthread_mutex_lock(&ondemand_mutex);
+    if (ondemand_stopping) {
+        pthread_mutex_unlock(&ondemand_mutex);
+        debug("[%s] fetch: request dropped, stopping", icao);
+        ondemand_request_free(request);
+        return;
+    }
+    for (int type = REPORT_METAR; type <= REPORT_TAF; type++) {
+        if (!(types & (1 << type)))
+            continue;
+        const char *name = type == REPORT_METAR ? "metar" : "taf";
+        ondemand_entry_t *entry = ondemand_entry(icao, (report_type_t)type);
+        if (!entry) {
+            cJSON_AddStringToObject(request->root, "error", "busy");
+        } else if (entry->result && !entry->in_flight && now - entry->fetched_at < cfg.ondemand_ttl) {
+            cJSON_AddItemToObject(request->root, name, cJSON_Duplicate(entry->result, 1));
+            cached++;
+            debug("[%s] fetch: %s served from cache (%lds old)", icao, name, (long)(now - entry->fetched_at));
+        } else {
+            if (!entry->in_flight) {
+                entry->in_flight = 1;
+                entry->queued = 1;
+                pthread_cond_signal(&ondemand_cond);
+            } else
+                debug("[%s] fetch: %s coalesced with request in flight", icao, name);
+            ondemand_attach(entry, request);
+        }
+    }
+    if (cached)
+        cJSON_AddBoolToObject(request->root, "cached", 1);
+    const int pending = request->pending;
+    pthread_mutex_unlock(&ondemand_mutex);
+    if (!pending)
+        ondemand_respond(request);
+}
+
+static cJSON *ondemand_fetch(const char *icao, report_type_t type) {
+    airport_t *ap = calloc(1, sizeof(airport_t));
+    if (!ap)
+        return NULL;
+    snprintf(ap->icao, sizeof(ap->icao), "%s", icao);
+    pthread_mutex_lock(&state_mutex);
+    const airport_t *configured = airport_find(icao);
+    const station_t *st = configured ? NULL : station_find(icao);
+    if (configured) {
+        memcpy(ap->name, configured->name, sizeof(ap->name));
+        memcpy(ap->country, configured->country, sizeof(ap->country));
+        ap->lat = configured->lat;
+        ap->lon = configured->lon;
+        ap->elev = configured->elev;
+        ap->templates = configured->templates;
+    } else {
+        if (st) {
             memcpy(ap->name, st->name, sizeof(ap->name));
             memcpy(ap->country, st->country, sizeof(ap->country));
             ap->lat = st->lat;
             ap->lon = st->lon;
-            ap->elev = st->elev_km * 1000; // metres
+            ap->elev = st->elev_km * 1000;
+        }
+        ap->templates = cfg.default_templates;
+    }
+    pthread_mutex_unlock(&state_mutex);
+
+    // parsed on the copy without state_mutex, templates_render takes it for cfg.templates
+    cJSON *report = NULL;
+    char path[MAX_URL];
+    if (type == REPORT_METAR)
+        snprintf(path, sizeof(path), "/metar?format=xml&taf=false&ids=%s", icao);
+    else
+        snprintf(path, sizeof(path), "/taf?format=xml&ids=%s", icao);
+    if (ratelimit_take(&ratelimit, PRIORITY_NORMAL)) {
+        char *xml = fetch_upstream(path, icao, PRIORITY_NORMAL);
+        if (xml) {
+            report = type == REPORT_METAR ? process_metar(xml, ap, NULL) : process_taf(xml, ap, NULL, NULL);
+            free(xml);
+        }
+    }
+    free(ap);
+    return report;
+}
+
+static void *ondemand_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&ondemand_mutex);
+    while (running) {
+        ondemand_entry_t *entry = NULL;
+        for (int i = 0; i < ONDEMAND_ENTRIES && !entry; i++)
+            if (ondemand_entries[i].queued)
+                entry = &ondemand_entries[i];
+        if (!entry) {
+            pthread_cond_wait(&ondemand_cond, &ondemand_mutex);
+            continue;
+        }
+        entry->queued = 0;
+        char icao[MAX_ICAO];
+        memcpy(icao, entry->icao, sizeof(icao));
+        const report_type_t type = entry->type;
+        pthread_mutex_unlock(&ondemand_mutex);
+
+        const int64_t start = trace_now();
+        cJSON *report = ondemand_fetch(icao, type);
+        trace_end("on-demand fetch", icao, start);
+        debug("[%s] fetch: %s on demand %s", icao, type == REPORT_METAR ? "METAR" : "TAF", report ? "fetched" : "failed");
+
+        pthread_mutex_lock(&ondemand_mutex);
+        if (entry->result)
+            cJSON_Delete(entry->result);
+        entry->result = report;
+        entry->fetched_at = report ? time(NULL) : 0;
+        entry->in_flight = 0;
+        ondemand_waiter_t *waiter = entry->waiters, *ready = NULL;
+        entry->waiters = NULL;
+        while (waiter) {
+            ondemand_waiter_t *next = waiter->next;
+            ondemand_request_t *request = waiter->request;
+            if (report)
+                cJSON_AddItemToObject(request->root, type == REPORT_METAR ? "metar" : "taf", cJSON_Duplicate(report, 1));
+            else
+                cJSON_AddStringToObject(request->root, type == REPORT_METAR ? "metar_error" : "taf_error", "fetch failed");
+            if (--request->pending == 0) {
+                waiter->next = ready;
+                ready = waiter;
+            } else
+                free(waiter);
+            waiter = next;
+        }
+        pthread_mutex_unlock(&ondemand_mutex);
+        while (ready) {
+            ondemand_waiter_t *next = ready->next;
+            ondemand_respond(ready->request);
+            free(ready);
+            ready = next;
+        }
+        pthread_mutex_lock(&ondemand_mutex);
+    }
+    pthread_mutex_unlock(&ondemand_mutex);
+    return NULL;
+}
+
+static void ondemand_start(void) {
+    for (int i = 0; i < cfg.ondemand_workers && i < ONDEMAND_WORKERS_MAX; i++)
+        if (pthread_create(&ondemand_threads[ondemand_thread_count], NULL, ondemand_worker, NULL) == 0)
+            ondemand_thread_count++;
+    printf("fetch: on-demand requests on %s/%s/+ (%d worker(s), cache %d seconds)\n", cfg.topic_prefix, ONDEMAND_TOPIC, ondemand_thread_count, cfg.ondemand_ttl);
+}
+
+// the network thread may still deliver requests: once stopping is set they are dropped instead of waiting for a worker
+static void ondemand_stop(void) {
+    char topic[MAX_TOPIC];
+    snprintf(topic, sizeof(topic), "%s/%s/+", cfg.topic_prefix, ONDEMAND_TOPIC);
+    if (cfg.ondemand_workers > 0)
+        mosquitto_unsubscribe(mosq, NULL, topic);
+    pthread_mutex_lock(&ondemand_mutex);
+    ondemand_stopping = 1;
+    pthread_cond_broadcast(&ondemand_cond);
+    pthread_mutex_unlock(&ondemand_mutex);
+    for (int i = 0; i < ondemand_thread_count; i++)
+        pthread_join(ondemand_threads[i], NULL);
+    ondemand_thread_count = 0;
+    pthread_mutex_lock(&ondemand_mutex);
+    for (int i = 0; i < ONDEMAND_ENTRIES; i++) {
+        ondemand_entry_t *entry = &ondemand_entries[i];
+        while (entry->waiters) {
+            ondemand_waiter_t *next = entry->waiters->next;
+            if (--entry->waiters->request->pending == 0)
+                ondemand_request_free(entry->waiters->request);
+            free(entry->waiters);
+            entry->waiters = next;
+        }
+        if (entry->result)
+            cJSON_Delete(entry->result);
+        memset(entry, 0, sizeof(*entry));
+    }
+    pthread_mutex_unlock(&ondemand_mutex);
+}
+
+static uint64_t hash64(const char *str) {
+    uint64_t hash = 14695981039346656037ull;
+    while (*str)
+        hash = (hash ^ (uint8_t)*str++) * 1099511628211ull;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static void cluster_topic(char *topic, size_t sz, const char *kind, const char *name) {
+    snprintf(topic, sz, "%s/%s/%s/%s", cfg.topic_prefix, CLUSTER_TOPIC, kind, name);
+}
+
+static void cluster_presence(int online) {
+    char topic[MAX_TOPIC];
+    cluster_topic(topic, sizeof(topic), "node", cfg.cluster_node);
+    if (!online) {
+        mosquitto_publish(mosq, NULL, topic, 0, NULL, 1, true);
+        return;
+    }
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "node", cfg.cluster_node);
+    char stamp[32];
+    cJSON_AddStringToObject(root, "heartbeat", timestamp_to_str(stamp, sizeof(stamp), time(NULL)));
+    cJSON_AddNumberToObject(root, "airports", cluster_owned);
+    char *payload = cJSON_PrintUnformatted(root);
+    mosquitto_publish(mosq, NULL, topic, (int)strlen(payload), payload, 1, true);
+    free(payload);
+    cJSON_Delete(root);
+}
+
+static cJSON *schedule_to_json(const schedule_t *sched) {
+    cJSON *json = cJSON_CreateObject();
+    cJSON *samples = cJSON_AddArrayToObject(json, "samples");
+    for (int i = 0; i < sched->sample_count; i++)
+        cJSON_AddItemToArray(samples, cJSON_CreateNumber((double)sched->samples[i]));
+    cJSON_AddNumberToObject(json, "learned_period", sched->learned_period);
+    cJSON_AddNumberToObject(json, "last_issued", (double)sched->last_issued);
+    cJSON_AddNumberToObject(json, "last_special", (double)sched->last_special);
+    cJSON_AddNumberToObject(json, "next_fetch", (double)sched->next_fetch);
+    cJSON_AddNumberToObject(json, "failures", sched->failures);
+    cJSON_AddNumberToObject(json, "retry_at", (double)sched->retry_at);
+    cJSON_AddNumberToObject(json, "last_archived", (double)sched->last_archived);
+    return json;
+}
+
+static void schedule_from_json(schedule_t *sched, const cJSON *json) {
+    if (!json)
+        return;
+    const cJSON *v;
+    sched->sample_count = 0;
+    cJSON_ArrayForEach(v, cJSON_GetObjectItem(json, "samples")) {
+        if (sched->sample_count < LEARN_SAMPLES)
+            sched->samples[sched->sample_count++] = (time_t)v->valuedouble;
+    }
+    if ((v = cJSON_GetObjectItem(json, "learned_period")))
+        sched->learned_period = v->valueint;
+    if ((v = cJSON_GetObjectItem(json, "last_issued")))
+        sched->last_issued = (time_t)v->valuedouble;
+    if ((v = cJSON_GetObjectItem(json, "last_special")))
+        sched->last_special = (time_t)v->valuedouble;
+    if ((v = cJSON_GetObjectItem(json, "next_fetch")))
+        sched->next_fetch = (time_t)v->valuedouble;
+    if ((v = cJSON_GetObjectItem(json, "failures")))
+        sched->failures = v->valueint;
+    if ((v = cJSON_GetObjectItem(json, "retry_at")))
+        sched->retry_at = (time_t)v->valuedouble;
+    if ((v = cJSON_GetObjectItem(json, "last_archived")))
+        sched->last_archived = (time_t)v->valuedouble;
+    sched->seeded = 1;
+}
+
+// schedule state is replicated (retained) after each fetch, so whichever node owns the airport next carries on from it
+static void cluster_state_publish(const airport_t *ap) {
+    char topic[MAX_TOPIC];
+    cluster_topic(topic, sizeof(topic), "state", ap->icao);
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "node", cfg.cluster_node);
+    cJSON_AddNumberToObject(root, "last_fetch", (double)ap->last_fetch);
+    cJSON_AddItemToObject(root, "metar", schedule_to_json(&ap->sched_metar));
+    cJSON_AddItemToObject(root, "taf", schedule_to_json(&ap->sched_taf));
+    char *payload = cJSON_PrintUnformatted(root);
+    mosquitto_publish(mosq, NULL, topic, (int)strlen(payload), payload, 1, true);
+    free(payload);
+    cJSON_Delete(root);
+}
+
+static void cluster_state_apply(const char *icao, const cJSON *state) {
+    pthread_mutex_lock(&state_mutex);
+    airport_t *ap = airport_find(icao);
+    if (ap && !ap->owned) {
+        const cJSON *v;
+        schedule_from_json(&ap->sched_metar, cJSON_GetObjectItem(state, "metar"));
+        schedule_from_json(&ap->sched_taf, cJSON_GetObjectItem(state, "taf"));
+        if ((v = cJSON_GetObjectItem(state, "last_fetch")))
+            ap->last_fetch = (time_t)v->valuedouble;
+        debug("[%s] cluster: schedule state received from %s", icao, cJSON_GetStringValue(cJSON_GetObjectItem(state, "node")));
+    }
+    pthread_mutex_unlock(&state_mutex);
+}
+
+static void cluster_node_update(const char *id, int online) {
+    pthread_mutex_lock(&cluster_mutex);
+    int index = -1;
+    for (int i = 0; i < cluster_node_count && index < 0; i++)
+        if (strcmp(cluster_nodes[i].id, id) == 0)
+            index = i;
+    if (online && index < 0 && cluster_node_count < MAX_CLUSTER_NODES) {
+        index = cluster_node_count++;
+        snprintf(cluster_nodes[index].id, sizeof(cluster_nodes[index].id), "%s", id);
+        cluster_changed = 1;
+        printf("cluster: node %s joined\n", id);
+    }
+    if (online && index >= 0)
+        cluster_nodes[index].seen = time(NULL);
+    else if (!online && index >= 0 && strcmp(id, cfg.cluster_node) != 0) {
+        cluster_nodes[index] = cluster_nodes[--cluster_node_count];
+        cluster_changed = 1;
+        printf("cluster: node %s left\n", id);
+    }
+    pthread_mutex_unlock(&cluster_mutex);
+}
+
+static void cluster_message(const char *rest, const struct mosquitto_message *msg) {
+    if (strncmp(rest, "node/", 5) == 0) {
+        cJSON *presence = msg->payloadlen > 0 ? cJSON_ParseWithLength((const char *)msg->payload, (size_t)msg->payloadlen) : NULL;
+        // liveness goes by our own receive time ('seen'), never the peer's clock: a retained presence left behind by a node that
+        // died without its will being delivered counts once and then times out in cluster_tick like any silent node
+        cluster_node_update(rest + 5, presence != NULL);
+        if (presence)
+            cJSON_Delete(presence);
+    } else if (strncmp(rest, "state/", 6) == 0 && msg->payloadlen > 0) {
+        cJSON *state = cJSON_ParseWithLength((const char *)msg->payload, (size_t)msg->payloadlen);
+        if (state) {
+            cluster_state_apply(rest + 6, state);
+            cJSON_Delete(state);
+        }
+    }
+}
+
+static int cluster_point_compare(const void *a, const void *b) {
+    const uint64_t ha = ((const cluster_point_t *)a)->hash, hb = ((const cluster_point_t *)b)->hash;
+    return ha < hb ? -1 : ha > hb ? 1 : 0;
+}
+
+// consistent hash ring with cluster_vnodes points per node: a node joining or leaving only moves the airports adjacent to its points
+static int cluster_ring_build(cluster_node_t *nodes, int count, cluster_point_t *ring) {
+    int points = 0;
+    for (int i = 0; i < count; i++)
+        for (int v = 0; v < cfg.cluster_vnodes; v++) {
+            char key[80];
+            snprintf(key, sizeof(key), "%.63s#%d", nodes[i].id, v);
+            ring[points++] = (cluster_point_t){hash64(key), i};
+        }
+    qsort(ring, (size_t)points, sizeof(cluster_point_t), cluster_point_compare);
+    return points;
+}
+
+static int cluster_ring_owner(const cluster_point_t *ring, int points, const char *icao) {
+    const uint64_t hash = hash64(icao);
+    int lo = 0, hi = points;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return ring[lo == points ? 0 : lo].node;
+}
+
+// caller holds state_mutex
+static void cluster_assign(void) {
+    cluster_node_t nodes[MAX_CLUSTER_NODES];
+    pthread_mutex_lock(&cluster_mutex);
+    const int count = cluster_node_count;
+    memcpy(nodes, cluster_nodes, sizeof(cluster_node_t) * (size_t)count);
+    pthread_mutex_unlock(&cluster_mutex);
+    cluster_point_t *ring = malloc(sizeof(cluster_point_t) * (size_t)(count * cfg.cluster_vnodes));
+    if (!ring)
+        return;
+    const int points = cluster_ring_build(nodes, count, ring);
+    int owned = 0, gained = 0, released = 0;
+    for (int i = 0; i < cfg.airport_count; i++) {
+        airport_t *ap = &cfg.airports[i];
+        const cluster_node_t *owner = &nodes[cluster_ring_owner(ring, points, ap->icao)];
+        const int mine = strcmp(owner->id, cfg.cluster_node) == 0;
+        if (mine && !ap->owned) {
+            debug("[%s] cluster: taking over", ap->icao);
+            gained++;
+        } else if (!mine && ap->owned) {
+            debug("[%s] cluster: handing over to %s", ap->icao, owner->id);
+            cluster_state_publish(ap);
+            released++;
+        }
+        ap->owned = mine;
+        owned += mine;
+    }
+    free(ring);
+    cluster_owned = owned;
+    if (cfg.snapshot_enabled && (gained || released) && !snapshot_changed)
+        snapshot_changed = time(NULL); // the node's snapshot covers the airports it owns
+    printf("cluster: %d node(s), own %d of %d airport(s) (%d gained, %d handed over)\n", count, owned, cfg.airport_count, gained, released);
+}
+
+static void cluster_tick(void) {
+    const time_t now = time(NULL);
+    pthread_mutex_lock(&cluster_mutex);
+    for (int i = 0; i < cluster_node_count; i++)
+        if (strcmp(cluster_nodes[i].id, cfg.cluster_node) != 0 && now - cluster_nodes[i].seen >= cfg.cluster_timeout) {
+            printf("cluster: node %s timed out\n", cluster_nodes[i].id);
+            cluster_nodes[i--] = cluster_nodes[--cluster_node_count];
+            cluster_changed = 1;
+        }
+    const int changed = cluster_changed;
+    cluster_changed = 0;
+    pthread_mutex_unlock(&cluster_mutex);
+    if (changed) {
+        pthread_mutex_lock(&state_mutex);
+        cluster_assign();
+        pthread_mutex_unlock(&state_mutex);
+    }
+    if (now >= cluster_heartbeat_at) {
+        cluster_presence(1);
+        cluster_heartbeat_at = now + cfg.cluster_heartbeat;
+    }
+}
+
+static void cluster_start(void) {
+    char topic[MAX_TOPIC];
+    cluster_topic(topic, sizeof(topic), "node", cfg.cluster_node);
+    mosquitto_will_set(mosq, topic, 0, NULL, 1, true);
+    cluster_node_update(cfg.cluster_node, 1);
+    printf("cluster: node %s (%d virtual node(s), heartbeat %d seconds)\n", cfg.cluster_node, cfg.cluster_vnodes, cfg.cluster_heartbeat);
+}
+
+static void cluster_stop(void) {
+    pthread_mutex_lock(&state_mutex);
+    for (int i = 0; i < cfg.airport_count; i++)
+        if (cfg.airports[i].owned)
+            cluster_state_publish(&cfg.airports[i]);
+    pthread_mutex_unlock(&state_mutex);
+    cluster_presence(0);
+}
+
+static int recover_topics(char topics[2][MAX_TOPIC]) {
+    char suffix[32];
+    compress_topic_suffix(suffix, sizeof(suffix));
+    if (!opts.split) {
+        snprintf(topics[0], MAX_TOPIC, "%s/+%s", cfg.topic_prefix, suffix);
+        return 1;
+    }
+    snprintf(topics[0], MAX_TOPIC, "%s/+/metar%s", cfg.topic_prefix, suffix);
+    snprintf(topics[1], MAX_TOPIC, "%s/+/taf%s", cfg.topic_prefix, suffix);
+    return 2;
+}
+
+static void recover_seed_type(airport_t *ap, const cJSON *report, schedule_t *sched, const char *field, const char *type) {
+    const time_t t = parse_iso_time(cJSON_GetStringValue(cJSON_GetObjectItem(report, field)));
+    if (t <= sched->last_issued)
+        return;
+    sched->seeded = 1;
+    if (cJSON_IsTrue(cJSON_GetObjectItem(report, "off_cycle"))) {
+        if (t <= sched->last_special)
             return;
+        sched->last_special = t;
+        recovered++;
+        char stamp[32];
+        debug("[%s] %s recovered from retained (off-cycle): %s", ap->icao, type, timestamp_to_str(stamp, sizeof(stamp), t));
+        return;
+    }
+    sched->last_issued = t;
+    if (opts.learn)
+        schedule_add_sample(sched, ap->icao, t);
+    recovered++;
+    char stamp[32];
+    debug("[%s] %s recovered from retained: %s", ap->icao, type, timestamp_to_str(stamp, sizeof(stamp), t));
+}
+
+static void recover_seed(const char *icao, const cJSON *payload) {
+    pthread_mutex_lock(&state_mutex);
+    airport_t *ap = airport_find(icao);
+    if (ap) {
+        const cJSON *metar = cJSON_GetObjectItem(payload, "metar"), *taf = cJSON_GetObjectItem(payload, "taf");
+        if (metar && ap->fetch_metar)
+            recover_seed_type(ap, metar, &ap->sched_metar, "observed", "METAR");
+        if (taf && ap->fetch_taf)
+            recover_seed_type(ap, taf, &ap->sched_taf, "issued", "TAF");
+    }
+    pthread_mutex_unlock(&state_mutex);
+}
+
+static void recover_retained(void) {
+    int expected = 0;
+    for (int i = 0; i < cfg.airport_count; i++)
+        expected += cfg.airports[i].fetch_metar + cfg.airports[i].fetch_taf;
+    const time_t deadline = time(NULL) + cfg.recover_seconds;
+    int seeded;
+    do {
+        usleep(100000);
+        pthread_mutex_lock(&state_mutex);
+        seeded = recovered;
+        pthread_mutex_unlock(&state_mutex);
+    } while (running && seeded < expected && time(NULL) < deadline);
+    recovering = 0;
+    char topics[2][MAX_TOPIC];
+    const int count = recover_topics(topics);
+    for (int i = 0; i < count; i++)
+        mosquitto_unsubscribe(mosq, NULL, topics[i]);
+    printf("recover: %d of %d report(s) seeded from retained messages\n", seeded, expected);
+}
+
+static void mqtt_message(const struct mosquitto_message *msg, const mosquitto_property *props) {
+    const size_t prefix_len = strlen(cfg.topic_prefix);
+    if (strncmp(msg->topic, cfg.topic_prefix, prefix_len) != 0 || msg->topic[prefix_len] != '/')
+        return;
+    const char *p = msg->topic + prefix_len + 1;
+    if (cfg.cluster_enabled && strncmp(p, CLUSTER_TOPIC "/", strlen(CLUSTER_TOPIC) + 1) == 0) {
+        cluster_message(p + strlen(CLUSTER_TOPIC) + 1, msg);
+        return;
+    }
+    char icao[MAX_ICAO] = {0};
+    size_t i = 0;
+    while (*p && *p != '/' && i < MAX_ICAO - 1)
+        icao[i++] = *p++;
+    char rest[MAX_TOPIC], suffix[32];
+    snprintf(rest, sizeof(rest), "%s", p);
+    compress_topic_suffix(suffix, sizeof(suffix));
+    const size_t rest_len = strlen(rest), suffix_len = strlen(suffix);
+    if (suffix_len && rest_len >= suffix_len && strcmp(rest + rest_len - suffix_len, suffix) == 0)
+        rest[rest_len - suffix_len] = '\0';
+    p = rest;
+    cJSON *request = NULL;
+    char *inflated = recovering && msg->retain && msg->payloadlen > 0 ? compress_inflate(msg->payload, (size_t)msg->payloadlen) : NULL;
+    if (inflated) {
+        request = cJSON_Parse(inflated);
+        free(inflated);
+    } else if (msg->payloadlen > 0)
+        request = cJSON_ParseWithLength((const char *)msg->payload, (size_t)msg->payloadlen);
+    if (strcmp(p, "/history/req") == 0)
+        history_request(icao, request, props);
+    else if (cfg.ondemand_workers > 0 && strcmp(icao, ONDEMAND_TOPIC) == 0 && *p == '/')
+        ondemand_request(p + 1, request, props);
+    else if (recovering && msg->retain && request && (!*p || strcmp(p, "/metar") == 0 || strcmp(p, "/taf") == 0))
+        recover_seed(icao, request);
+    if (request)
+        cJSON_Delete(request);
+}
+
+static void mqtt_subscribe_all(struct mosquitto *m) {
+    if (cfg.history_depth > 0) {
+        char topic[MAX_TOPIC];
+        snprintf(topic, sizeof(topic), "%s/+/history/req", cfg.topic_prefix);
+        mosquitto_subscribe(m, NULL, topic, 0);
+        debug("mqtt: subscribed to %s", topic);
+    }
+    if (cfg.ondemand_workers > 0) {
+        char topic[MAX_TOPIC];
+        snprintf(topic, sizeof(topic), "%s/%s/+", cfg.topic_prefix, ONDEMAND_TOPIC);
+        mosquitto_subscribe(m, NULL, topic, 0);
+        debug("mqtt: subscribed to %s", topic);
+    }
+    if (cfg.cluster_enabled) {
+        char topic[MAX_TOPIC];
+        cluster_topic(topic, sizeof(topic), "+", "+");
+        mosquitto_subscribe(m, NULL, topic, 1);
+        debug("mqtt: subscribed to %s", topic);
+    }
+    if (recovering) {
+        char topics[2][MAX_TOPIC];
+        const int count = recover_topics(topics);
+        for (int i = 0; i < count; i++) {
+            mosquitto_subscribe(m, NULL, topics[i], 0);
+            debug("mqtt: subscribed to %s (recovery)", topics[i]);
         }
     }
 }
 
-// -----------------------------------------------------------------------------------------------------------------------------------------
-// -----------------------------------------------------------------------------------------------------------------------------------------
+static void mqtt_message_cb(struct mosquitto *m, void *userdata, const struct mosquitto_message *msg) {
+    (void)m;
+    (void)userdata;
+    mqtt_message(msg, NULL);
+}
+
+static void mqtt_message_v5_cb(struct mosquitto *m, void *userdata, const struct mosquitto_message *msg, const mosquitto_property *props) {
+    (void)m;
+    (void)userdata;
+    mqtt_message(msg, props);
+}
+
+static void mqtt_connect_cb(struct mosquitto *m, void *userdata, int rc) {
+    (void)userdata;
+    if (rc != 0) {
+        debug("mqtt: connect refused (%s)", mosquitto_strerror(rc));
+        return;
+    }
+    debug("mqtt: connected");
+    mqtt_subscribe_all(m);
+}
+
+static void mqtt_connect_v5_cb(struct mosquitto *m, void *userdata, int rc, int flags, const mosquitto_property *props) {
+    (void)userdata;
+    (void)flags;
+    if (rc != 0) {
+        debug("mqtt: connect refused (%s)", mosquitto_strerror(rc));
+        return;
+    }
+    uint16_t maximum = 0;
+    mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &maximum, false);
+    topic_alias_maximum = maximum;
+    topic_alias_reset = 1;
+    debug("mqtt: connected (v5, topic alias maximum %d)", topic_alias_maximum);
+    mqtt_subscribe_all(m);
+}
 
 static void signal_handler(int sig) {
-    (void)sig;
-    running = 0;
+    if (sig == SIGHUP)
+        reload = 1;
+    else if (sig == SIGUSR1)
+        trace_dump_requested = 1;
+    else
+        running = 0;
 }
 
 static void usage(const char *prog) {
@@ -1052,19 +5653,28 @@ static void usage(const char *prog) {
     fprintf(stderr, "  -a, --all           Publish all fetches (don't skip unchanged)\n");
     fprintf(stderr, "  -l, --learn         Learn fetch schedule (default when not -a)\n");
     fprintf(stderr, "  -s, --split         Split METAR/TAF into separate topics\n");
+    fprintf(stderr, "  -D, --dump FILE     Dump an archive segment file and exit\n");
+    fprintf(stderr, "  -T, --trace FILE    Record stage timings, write trace-event JSON to FILE on SIGUSR1 and exit\n");
+    fprintf(stderr, "  -Z, --train DICT    Train a compression dictionary from the archive segments given as arguments and exit\n");
+    fprintf(stderr, "  -S, --simulate WHAT Run the scheduler on a virtual clock over a scenario (all, %s", sim_scenarios[0].name);
+    for (size_t i = 1; i < sizeof(sim_scenarios) / sizeof(sim_scenarios[0]); i++)
+        fprintf(stderr, ", %s", sim_scenarios[i].name);
+    fprintf(stderr, ") or an archive segment and exit\n");
     fprintf(stderr, "  -h, --help          Show this help\n");
 }
 
 int main(int argc, char **argv) {
     static struct option long_options[] = {
         {"config", required_argument, 0, 'c'}, {"debug", no_argument, 0, 'd'}, {"header", no_argument, 0, 'H'}, {"all", no_argument, 0, 'a'},
-        {"learn", no_argument, 0, 'l'},        {"split", no_argument, 0, 's'}, {"help", no_argument, 0, 'h'},   {0, 0, 0, 0},
+        {"learn", no_argument, 0, 'l'},        {"split", no_argument, 0, 's'}, {"help", no_argument, 0, 'h'},   {"dump", required_argument, 0, 'D'},
+        {"trace", required_argument, 0, 'T'}, {"train", required_argument, 0, 'Z'}, {"simulate", required_argument, 0, 'S'}, {0, 0, 0, 0},
     };
-    int opt;
-    while ((opt = getopt_long(argc, argv, "c:dHalsh", long_options, NULL)) != -1) {
+    int opt, config_given = 0;
+    while ((opt = getopt_long(argc, argv, "c:dHalshD:T:Z:S:", long_options, NULL)) != -1) {
         switch (opt) {
         case 'c':
             opts.config_path = optarg;
+            config_given = 1;
             break;
         case 'd':
             opts.debug = 1;
@@ -1082,6 +5692,18 @@ int main(int argc, char **argv) {
         case 's':
             opts.split = 1;
             break;
+        case 'D':
+            opts.archive_dump = optarg;
+            break;
+        case 'T':
+            opts.trace = optarg;
+            break;
+        case 'Z':
+            opts.train = optarg;
+            break;
+        case 'S':
+            opts.simulate = optarg;
+            break;
         case 'h':
             usage(argv[0]);
             return EXIT_SUCCESS;
@@ -1091,33 +5713,62 @@ int main(int argc, char **argv) {
         }
     }
 
-    memset(&cfg, 0, sizeof(cfg));
-    strcpy(cfg.broker, "localhost");
-    strcpy(cfg.client_id, "avw2mqtt");
-    strcpy(cfg.topic_prefix, "weather/aviation");
-    cfg.default_metar = cfg.default_taf = 1;
-    cfg.default_interval = 10;
+    if (opts.archive_dump)
+        return archive_dump(opts.archive_dump) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 
+    config_defaults();
+    if (opts.simulate) {
+        // the scheduler knobs (default interval, startup spread, priorities) come from the config when one is given
+        if (config_given && config_load(opts.config_path) < 0)
+            return EXIT_FAILURE;
+        return simulate(opts.simulate) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
     if (config_load(opts.config_path) < 0)
         return EXIT_FAILURE;
+    if (cfg.stationinfo_enabled && cfg.stationinfo_cache[0])
+        stationinfo_load(cfg.stationinfo_cache);
+    airports_setup();
     if (cfg.airport_count == 0) {
         fprintf(stderr, "airports: none configured\n");
         return EXIT_FAILURE;
     }
     printf("airports: loaded %d item(s)\n", cfg.airport_count);
+    if (opts.train)
+        return compress_train(opts.train, argv + optind, argc - optind) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 
-    if (cfg.stations_file[0])
-        stations_load(cfg.stations_file, station_match_cb, NULL);
-    airports_build_json();
+    srand((unsigned int)(time(NULL) ^ getpid()));
+    ratelimit_init(&ratelimit, cfg.rate_per_minute, cfg.rate_burst);
+    airports_spread(0);
 
     debug("mode: %s", opts.all ? "all (publish every fetch)" : "smart (skip unchanged)");
     debug("learning: %s", opts.learn ? "enabled" : "disabled");
+    if (cfg.history_depth > 0)
+        debug("history: %d report(s) per airport", cfg.history_depth);
+    if (cfg.archive_directory[0])
+        debug("archive: %s (flush every %d record(s) or %d seconds)", cfg.archive_directory, cfg.archive_flush_records, cfg.archive_flush_seconds);
+    if (cfg.rate_per_minute > 0)
+        debug("rate limit: %.1f requests/minute (burst %.0f)", cfg.rate_per_minute, ratelimit.burst);
+    for (int i = 0; i < cfg.endpoint_count; i++)
+        debug("upstream: %s%s", cfg.endpoints[i].base, i == 0 ? " (preferred)" : "");
+    debug("upstream: timeout %d seconds, hedging %s", cfg.upstream_timeout, cfg.upstream_hedge ? "enabled" : "disabled");
     debug("topics: %s", opts.split ? "split (metar/taf separate)" : "combined");
+    debug("protocol: %s", cfg.protocol_version == MQTT_PROTOCOL_V5 ? "v5 (topic aliases, expiry, properties)" : "v3.1.1");
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGHUP, signal_handler);
+    signal(SIGUSR1, signal_handler);
 
     curl_global_init(CURL_GLOBAL_DEFAULT);
+    xmlInitParser(); // before any worker threads parse
+    stationinfo_update(0);
+
+    if (cfg.shm_name[0] && shm_feed_open() < 0)
+        return EXIT_FAILURE;
+    if (compress_open() < 0)
+        return EXIT_FAILURE;
+    if (cfg.compress && !compress_active())
+        fprintf(stderr, "mqtt: format zstd but no dictionary is loaded, publishing json\n");
 
     mosquitto_lib_init();
     mosq = mosquitto_new(cfg.client_id, true, NULL);
@@ -1127,34 +5778,74 @@ int main(int argc, char **argv) {
     }
     if (cfg.username[0])
         mosquitto_username_pw_set(mosq, cfg.username, cfg.password);
-    char host[256];
-    int port = 1883;
-    strncpy(host, cfg.broker, sizeof(host));
-    char *h = host;
-    if (strncmp(h, "mqtt://", 7) == 0)
-        h += 7;
-    char *colon = strchr(h, ':');
-    if (colon) {
-        *colon = 0;
-        port = atoi(colon + 1);
+    if (cfg.protocol_version == MQTT_PROTOCOL_V5) {
+        mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+        mosquitto_connect_v5_callback_set(mosq, mqtt_connect_v5_cb);
+        mosquitto_message_v5_callback_set(mosq, mqtt_message_v5_cb);
+    } else {
+        mosquitto_connect_callback_set(mosq, mqtt_connect_cb);
+        mosquitto_message_callback_set(mosq, mqtt_message_cb);
     }
-    printf("mqtt: connecting to %s:%d\n", h, port);
-    if (mosquitto_connect(mosq, h, port, 60) != MOSQ_ERR_SUCCESS) {
+    char host[256];
+    const int port = broker_address(cfg.broker, host, sizeof(host));
+    if (cfg.cluster_enabled)
+        cluster_start();
+    printf("mqtt: connecting to %s:%d\n", host, port);
+    if (mosquitto_connect(mosq, host, port, 60) != MOSQ_ERR_SUCCESS) {
         fprintf(stderr, "mqtt: connect failed\n");
         return EXIT_FAILURE;
     }
+    recovering = cfg.recover_seconds > 0 && !opts.all;
+    if (cfg.ondemand_workers > 0)
+        ondemand_start();
     mosquitto_loop_start(mosq);
+    brokers_start();
+    if (recovering)
+        recover_retained();
+    if (cfg.cluster_enabled)
+        sleep(CLUSTER_SETTLE_SECONDS); // collect retained presence and schedule state before taking a share
 
     printf("running ... press Ctrl+C to stop.\n");
     while (running) {
+        if (reload) {
+            reload = 0;
+            config_reload();
+            stationinfo_check_at = 0;
+        }
+        if (cfg.cluster_enabled)
+            cluster_tick();
         for (int i = 0; i < cfg.airport_count && running; i++) {
             airport_t *ap = &cfg.airports[i];
-            if (should_fetch(ap))
+            if (ap->owned && should_fetch(ap)) {
                 fetch_and_publish(ap);
+                if (cfg.cluster_enabled)
+                    cluster_state_publish(ap);
+            }
+            if (ap->owned)
+                publish_effective(ap, time(NULL));
+        }
+        archive_tick();
+        snapshot_tick(time(NULL));
+        stationinfo_update(1);
+        if (trace_dump_requested && opts.trace) {
+            trace_dump_requested = 0;
+            trace_dump();
         }
         sleep(5);
     }
     printf("\nstopping ...\n");
+    ondemand_stop();
+    if (cfg.cluster_enabled)
+        cluster_stop();
+    brokers_stop();
+    archive_close();
+    shm_feed_close();
+    compress_close();
+    if (opts.trace)
+        trace_dump();
+    for (int i = 0; i < cfg.endpoint_count; i++)
+        debug("upstream: %s: %lu request(s), %lu error(s), p95 %d ms", cfg.endpoints[i].base, cfg.endpoints[i].requests, cfg.endpoints[i].errors,
+              endpoint_p95(&cfg.endpoints[i]));
 
     mosquitto_disconnect(mosq);
     mosquitto_loop_stop(mosq, true);
@@ -1162,6 +5853,7 @@ int main(int argc, char **argv) {
     mosquitto_lib_cleanup();
     curl_global_cleanup();
     airports_free();
+    stationinfo_free();
     return EXIT_SUCCESS;
 }
 
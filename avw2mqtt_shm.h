@@ -0,0 +1,159 @@
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// avw2mqtt shared-memory feed: latest-value slots per station and report type (seqlock protected), plus an event ring
+// announcing each update. Single writer (avw2mqtt), any number of read-only readers on the same host.
+//
+//   avw_shm_t *shm = avw_shm_open(AVW_SHM_NAME);
+//   uint64_t cursor = avw_shm_cursor(shm);
+//   avw_shm_event_t ev;
+//   avw_shm_slot_t slot;
+//   while (avw_shm_next_event(shm, &cursor, &ev) > 0)
+//       if (avw_shm_read_slot(shm, ev.slot, &slot))
+//           printf("%s %s\n", slot.icao, slot.raw);
+//
+// Zero-copy readers can use avw_shm_slot_begin()/avw_shm_slot_retry() around direct access to shm->slots[i] instead.
+
+#ifndef AVW2MQTT_SHM_H
+#define AVW2MQTT_SHM_H
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define AVW_SHM_NAME "/avw2mqtt"
+#define AVW_SHM_MAGIC 0x53575641u // "AVWS"
+#define AVW_SHM_VERSION 1
+#define AVW_SHM_SLOTS 128
+#define AVW_SHM_EVENTS 256
+#define AVW_SHM_ICAO 8
+#define AVW_SHM_RAW 512
+#define AVW_SHM_TEXT 4096
+
+#define AVW_SHM_TYPE_METAR 0
+#define AVW_SHM_TYPE_TAF 1
+
+#define AVW_SHM_FLAG_OFF_CYCLE 1u // SPECI or other report outside the routine schedule
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+typedef struct {
+    _Atomic uint32_t seq; // odd while being written
+    uint32_t type;
+    char icao[AVW_SHM_ICAO];
+    int64_t time;    // observed (METAR) or issued (TAF)
+    int64_t updated; // when written
+    uint32_t flags;
+    uint32_t reserved;
+    char raw[AVW_SHM_RAW];
+    char text[AVW_SHM_TEXT];
+} avw_shm_slot_t;
+
+typedef struct {
+    _Atomic uint64_t seq; // event number + 1 once complete
+    uint32_t slot;
+    uint32_t slot_seq;
+} avw_shm_event_t;
+
+typedef struct {
+    _Atomic uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count, event_count;
+    _Atomic uint64_t event_head; // events written so far
+    avw_shm_event_t events[AVW_SHM_EVENTS];
+    avw_shm_slot_t slots[AVW_SHM_SLOTS];
+} avw_shm_t;
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+static inline avw_shm_t *avw_shm_open(const char *name) {
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    void *base = mmap(NULL, sizeof(avw_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    avw_shm_t *shm = (avw_shm_t *)base;
+    if (atomic_load_explicit(&shm->magic, memory_order_acquire) != AVW_SHM_MAGIC || shm->version != AVW_SHM_VERSION) {
+        munmap(base, sizeof(avw_shm_t));
+        return NULL;
+    }
+    return shm;
+}
+
+static inline void avw_shm_close(avw_shm_t *shm) {
+    if (shm)
+        munmap((void *)shm, sizeof(avw_shm_t));
+}
+
+static inline uint32_t avw_shm_slot_begin(const avw_shm_slot_t *slot) {
+    uint32_t seq;
+    while ((seq = atomic_load_explicit(&slot->seq, memory_order_acquire)) & 1)
+        ;
+    return seq;
+}
+
+static inline int avw_shm_slot_retry(const avw_shm_slot_t *slot, uint32_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq;
+}
+
+static inline int avw_shm_read_slot(const avw_shm_t *shm, uint32_t index, avw_shm_slot_t *out) {
+    if (index >= shm->slot_count)
+        return 0;
+    const avw_shm_slot_t *slot = &shm->slots[index];
+    uint32_t seq;
+    do {
+        seq = avw_shm_slot_begin(slot);
+        memcpy((void *)out, (const void *)slot, sizeof(*out));
+    } while (avw_shm_slot_retry(slot, seq));
+    return seq != 0;
+}
+
+static inline int avw_shm_find(const avw_shm_t *shm, const char *icao, uint32_t type) {
+    for (uint32_t i = 0; i < shm->slot_count; i++) {
+        const avw_shm_slot_t *slot = &shm->slots[i];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != 0 && slot->type == type && strncmp(slot->icao, icao, AVW_SHM_ICAO) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+static inline uint64_t avw_shm_cursor(const avw_shm_t *shm) {
+    return atomic_load_explicit(&shm->event_head, memory_order_acquire);
+}
+
+// returns 1 with the next event, 0 if none pending, -1 if events were overwritten (cursor skips ahead to the oldest held)
+static inline int avw_shm_next_event(const avw_shm_t *shm, uint64_t *cursor, avw_shm_event_t *out) {
+    const uint64_t head = atomic_load_explicit(&shm->event_head, memory_order_acquire);
+    if (*cursor >= head)
+        return 0;
+    if (head - *cursor > shm->event_count) {
+        *cursor = head - shm->event_count;
+        return -1;
+    }
+    const avw_shm_event_t *ev = &shm->events[*cursor % shm->event_count];
+    if (atomic_load_explicit(&ev->seq, memory_order_acquire) != *cursor + 1) {
+        *cursor = head;
+        return -1;
+    }
+    out->slot = ev->slot;
+    out->slot_seq = ev->slot_seq;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&ev->seq, memory_order_relaxed) != *cursor + 1) {
+        *cursor = atomic_load_explicit(&shm->event_head, memory_order_acquire);
+        return -1;
+    }
+    atomic_store_explicit(&out->seq, *cursor + 1, memory_order_relaxed);
+    (*cursor)++;
+    return 1;
+}
+
+#endif
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------